@@ -0,0 +1,114 @@
+// elprep-bench.
+// Copyright (c) 2018-2023 imec vzw.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version, and Additional Terms
+// (see below).
+
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Affero General Public License for more details.
+
+// You should have received a copy of the GNU Affero General Public
+// License and Additional Terms along with this program. If not, see
+// <https://github.com/ExaScience/elprep-bench/blob/master/LICENSE.txt>.
+
+/* Bump allocator for the alignments of one batch and their fields.
+	 Individual deallocations are ignored; the blocks are released together
+	 when the last alignment of the batch goes away. Each batch is normally
+	 only touched by one task at a time, but later filters may still grow the
+	 fields of alignments from different batches concurrently, hence the
+	 (uncontended) spin lock. */
+const size_t batch_arena_block_size = 256 * 1024;
+
+class batch_arena {
+public:
+	spin_mutex m;
+	vector<char*> blocks;
+	size_t reserved;
+	char* next;
+	char* limit;
+
+	batch_arena () : reserved(0), next(nullptr), limit(nullptr) {}
+
+	batch_arena (const batch_arena&) = delete;
+	batch_arena& operator= (const batch_arena&) = delete;
+
+	~batch_arena () {
+		for (auto block: blocks) {
+			::operator delete(block);
+		}
+		count_deallocation(arena_memory, reserved);
+	}
+
+	inline char* new_block (size_t bytes) {
+		auto block = static_cast<char*>(::operator new(bytes));
+		blocks.push_back(block);
+		reserved += bytes;
+		count_allocation(arena_memory, bytes);
+		return block;
+	}
+
+	void* allocate (size_t bytes, size_t alignment) {
+		spin_mutex::scoped_lock lock(m);
+		auto p = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(next) + alignment - 1) & ~uintptr_t(alignment - 1));
+		if ((next == nullptr) || (p + bytes > limit)) {
+			if (bytes > batch_arena_block_size / 4) {
+				// large requests get a block of their own, so the current one stays in use
+				return new_block(bytes);
+			}
+			auto block = new_block(batch_arena_block_size);
+			limit = block + batch_arena_block_size;
+			p = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(block) + alignment - 1) & ~uintptr_t(alignment - 1));
+		}
+		next = p + bytes;
+		return p;
+	}
+};
+
+/* Allocates from a batch_arena, or from the heap when no arena is given.
+	 The allocator does not keep the arena alive; that is up to the owner of
+	 the allocated objects (see make_arena_alignment). Bytes are attributed to memory category C as if they
+	 were individual allocations, so the per-category numbers stay comparable
+	 with and without arenas. */
+template<typename T, memory_category C> class arena_allocator {
+public:
+	using value_type = T;
+
+	template<typename U> struct rebind {
+		using other = arena_allocator<U, C>;
+	};
+
+	batch_arena* arena;
+
+	arena_allocator () noexcept : arena(nullptr) {}
+
+	arena_allocator (batch_arena* arena) noexcept : arena(arena) {}
+
+	template<typename U> arena_allocator (const arena_allocator<U, C>& a) noexcept : arena(a.arena) {}
+
+	T* allocate (size_t n) {
+		count_allocation(C, n * sizeof(T));
+		if (arena != nullptr) {
+			return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+		} else {
+			return allocator<T>().allocate(n);
+		}
+	}
+
+	void deallocate (T* p, size_t n) {
+		count_deallocation(C, n * sizeof(T));
+		if (arena == nullptr) {
+			allocator<T>().deallocate(p, n);
+		}
+	}
+};
+
+template<typename T, typename U, memory_category C>
+inline bool operator== (const arena_allocator<T, C>& a1, const arena_allocator<U, C>& a2) {return a1.arena == a2.arena;}
+
+template<typename T, typename U, memory_category C>
+inline bool operator!= (const arena_allocator<T, C>& a1, const arena_allocator<U, C>& a2) {return a1.arena != a2.arena;}
@@ -0,0 +1,536 @@
+// elprep-bench.
+// Copyright (c) 2018-2023 imec vzw.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version, and Additional Terms
+// (see below).
+
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Affero General Public License for more details.
+
+// You should have received a copy of the GNU Affero General Public
+// License and Additional Terms along with this program. If not, see
+// <https://github.com/ExaScience/elprep-bench/blob/master/LICENSE.txt>.
+
+/* Compressed text input and output. Every output batch is compressed on
+	 its own, so batches can be compressed in parallel and their output
+	 simply concatenated.
+
+	 gzip output is BGZF: a series of gzip members of at most 64 KB, with
+	 the size of each member in an extra field and an empty member at the
+	 end. Any gzip reader decompresses it, and offsets into it can be indexed.
+	 zstd output has one frame per batch, and is only available when elprep
+	 is built with -DELPREP_ZSTD and linked with -lzstd. */
+
+enum compression_format {uncompressed, gzip_compression, zstd_compression};
+
+compression_format parse_compression_format (const string& name) {
+	if (name == "none") return uncompressed;
+	if (name == "gzip") return gzip_compression;
+	if (name == "zstd") {
+#ifdef ELPREP_ZSTD
+		return zstd_compression;
+#else
+		throw runtime_error("This elprep was built without zstd support.");
+#endif
+	}
+	throw runtime_error("Unknown compression format " + name + ".");
+}
+
+int default_compression_level (compression_format format) {
+	switch (format) {
+	case gzip_compression: return 6;
+	case zstd_compression: return 3;
+	default: return 0;
+	}
+}
+
+// As in htslib, so that compressed blocks always fit.
+const size_t bgzf_block_size = 0xff00;
+const size_t bgzf_max_block_size = 0x10000;
+const size_t bgzf_header_size = 18;
+const size_t bgzf_footer_size = 8;
+
+const char bgzf_eof[28] = {
+	'\x1f', '\x8b', '\x08', '\x04', 0, 0, 0, 0, 0, '\xff', 6, 0, 'B', 'C', 2, 0,
+	'\x1b', 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+inline void put_le (char* p, uint32_t value, int size) {
+	for (auto i = 0; i < size; ++i) p[i] = char(value >> (8 * i));
+}
+
+/* Appends text to out as BGZF blocks of at most bgzf_block_size input
+	 bytes, and the end of each block in out to block_ends. */
+void bgzf_compress (const char* text, size_t size, int level, string& out, vector<uint64_t>& block_ends) {
+	z_stream stream{};
+	if (deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		throw runtime_error("Cannot initialize zlib.");
+	}
+	for (size_t begin = 0; begin < size; begin += bgzf_block_size) {
+		auto n = min(bgzf_block_size, size - begin);
+		auto start = out.size();
+		out.resize(start + bgzf_max_block_size);
+		auto block = &out[start];
+		auto compress = [&](int block_level) {
+			deflateReset(&stream);
+			deflateParams(&stream, block_level, Z_DEFAULT_STRATEGY);
+			stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(text + begin));
+			stream.avail_in = n;
+			stream.next_out = reinterpret_cast<Bytef*>(block + bgzf_header_size);
+			stream.avail_out = bgzf_max_block_size - bgzf_header_size - bgzf_footer_size;
+			return deflate(&stream, Z_FINISH) == Z_STREAM_END;
+		};
+		// stored blocks always fit
+		if (!compress(level) && !compress(0)) {
+			throw runtime_error("BGZF block overflow.");
+		}
+		auto block_size = bgzf_header_size + stream.total_out + bgzf_footer_size;
+		const char header[] = {'\x1f', '\x8b', '\x08', '\x04', 0, 0, 0, 0, 0, '\xff', 6, 0, 'B', 'C', 2, 0};
+		memcpy(block, header, sizeof(header));
+		put_le(block + 16, block_size - 1, 2);
+		auto footer = block + bgzf_header_size + stream.total_out;
+		put_le(footer, crc32(crc32(0, nullptr, 0), reinterpret_cast<const Bytef*>(text + begin), n), 4);
+		put_le(footer + 4, n, 4);
+		out.resize(start + block_size);
+		block_ends.push_back(out.size());
+	}
+	deflateEnd(&stream);
+}
+
+#ifdef ELPREP_ZSTD
+/* Appends text to out as one zstd frame. */
+void zstd_compress (const char* text, size_t size, int level, string& out) {
+	auto start = out.size();
+	out.resize(start + ZSTD_compressBound(size));
+	auto n = ZSTD_compress(&out[start], out.size() - start, text, size, level);
+	if (ZSTD_isError(n)) {
+		throw runtime_error(string("zstd compression failed: ") + ZSTD_getErrorName(n));
+	}
+	out.resize(start + n);
+}
+#endif
+
+/* Compresses text in the given format, appending to out. block_ends gets
+	 the end of each block in out that starts at a known input offset: every
+	 bgzf_block_size input bytes for gzip, or the whole frame for zstd. */
+void compress_text (compression_format format, int level, const char* text, size_t size, string& out, vector<uint64_t>& block_ends) {
+	switch (format) {
+	case gzip_compression:
+		bgzf_compress(text, size, level, out, block_ends);
+		break;
+#ifdef ELPREP_ZSTD
+	case zstd_compression:
+		if (size > 0) {
+			zstd_compress(text, size, level, out);
+			block_ends.push_back(out.size());
+		}
+		break;
+#endif
+	default:
+		out.append(text, size);
+	}
+}
+
+/* Decompressed input. A reader thread cuts the compressed input into jobs
+	 of whole BGZF blocks or zstd frames, which TBB tasks decompress. The
+	 consumer takes the jobs in order, and decompresses a job itself if no
+	 task has claimed it yet, so it never waits for a task that has not
+	 started. Other gzip files can only be inflated in order, which the
+	 reader thread then does on its own. Lines that cross job boundaries are
+	 joined by istream_wrapper, as for any other istream. */
+
+const size_t decompression_job_size = 1 << 20;
+
+class decompression_job {
+public:
+	string compressed;
+	vector<size_t> ends; // of the blocks or frames in compressed
+	shared_ptr<string> text;
+	atomic<bool> claimed{false};
+	bool done = false;
+	exception_ptr error;
+};
+
+void bgzf_decompress (decompression_job& job) {
+	size_t size = 0;
+	for (auto end: job.ends) {
+		uint32_t isize;
+		memcpy(&isize, &job.compressed[end - 4], 4);
+		size += isize;
+	}
+	job.text = make_input_buffer(size);
+	z_stream stream{};
+	if (inflateInit2(&stream, -15) != Z_OK) {
+		throw runtime_error("Cannot initialize zlib.");
+	}
+	size_t position = 0, begin = 0;
+	for (auto end: job.ends) {
+		auto block = reinterpret_cast<const unsigned char*>(&job.compressed[begin]);
+		uint32_t crc, isize;
+		memcpy(&crc, block + (end - begin) - 8, 4);
+		memcpy(&isize, block + (end - begin) - 4, 4);
+		auto out = reinterpret_cast<Bytef*>(&(*job.text)[position]);
+		inflateReset(&stream);
+		stream.next_in = const_cast<Bytef*>(block + bgzf_header_size);
+		stream.avail_in = (end - begin) - bgzf_header_size - bgzf_footer_size;
+		stream.next_out = out;
+		stream.avail_out = isize;
+		auto result = inflate(&stream, Z_FINISH);
+		if ((result != Z_STREAM_END) || (stream.avail_out != 0) || (crc32(crc32(0, nullptr, 0), out, isize) != crc)) {
+			inflateEnd(&stream);
+			throw runtime_error("Corrupt BGZF block.");
+		}
+		position += isize;
+		begin = end;
+	}
+	inflateEnd(&stream);
+}
+
+#ifdef ELPREP_ZSTD
+void zstd_decompress (decompression_job& job) {
+	size_t size = 0, begin = 0;
+	for (auto end: job.ends) {
+		auto frame_size = ZSTD_getFrameContentSize(&job.compressed[begin], end - begin);
+		if ((frame_size != ZSTD_CONTENTSIZE_UNKNOWN) && (frame_size != ZSTD_CONTENTSIZE_ERROR)) size += frame_size;
+		begin = end;
+	}
+	job.text = make_input_buffer(size);
+	auto& text = *job.text;
+	text.clear();
+	begin = 0;
+	for (auto end: job.ends) {
+		auto frame = &job.compressed[begin];
+		auto size = ZSTD_getFrameContentSize(frame, end - begin);
+		auto position = text.size();
+		if ((size != ZSTD_CONTENTSIZE_UNKNOWN) && (size != ZSTD_CONTENTSIZE_ERROR)) {
+			text.resize(position + size);
+			auto n = ZSTD_decompress(&text[position], size, frame, end - begin);
+			if (ZSTD_isError(n) || (n != size)) {
+				throw runtime_error("Corrupt zstd frame.");
+			}
+		} else {
+			// frames written by streaming compressors may not record their size
+			unique_ptr<ZSTD_DCtx, size_t(*)(ZSTD_DCtx*)> context(ZSTD_createDCtx(), ZSTD_freeDCtx);
+			ZSTD_inBuffer in{frame, end - begin, 0};
+			while (true) {
+				text.resize(position + ZSTD_DStreamOutSize());
+				ZSTD_outBuffer out{&text[position], text.size() - position, 0};
+				auto result = ZSTD_decompressStream(context.get(), &out, &in);
+				if (ZSTD_isError(result)) {
+					throw runtime_error(string("zstd decompression failed: ") + ZSTD_getErrorName(result));
+				}
+				position += out.pos;
+				if (result == 0) break;
+				if ((in.pos == in.size) && (out.pos < out.size)) {
+					throw runtime_error("Truncated zstd frame.");
+				}
+			}
+			text.resize(position);
+		}
+		begin = end;
+	}
+}
+#endif
+
+class decompressing_buffer : public streambuf {
+public:
+	istream& input;
+	compression_format format;
+	mutex lock;
+	condition_variable changed;
+	deque<shared_ptr<decompression_job>> jobs;
+	size_t max_jobs;
+	bool finished, stopping;
+	exception_ptr reader_error;
+	/* Dedicated threads rather than tasks: underflow runs on the
+		 istream_wrapper's reader thread, and the pipeline stages that wait for
+		 it may occupy all slots of the pipeline's arena. */
+	vector<thread> decompressors;
+	thread reader;
+	shared_ptr<string> current;
+
+	decompressing_buffer (istream& input, compression_format format, int threads) :
+		input(input), format(format), max_jobs(2 * max(threads, 1)), finished(false), stopping(false) {
+		for (auto i = 0; i < max(threads, 1); ++i) {
+			decompressors.emplace_back([this](){decompress_jobs();});
+		}
+		reader = thread([this](){
+				try {
+					if (this->format == zstd_compression) {
+						read_zstd_frames();
+					} else {
+						read_gzip_members();
+					}
+				} catch (...) {
+					lock_guard<mutex> guard(lock);
+					reader_error = current_exception();
+				}
+				lock_guard<mutex> guard(lock);
+				finished = true;
+				changed.notify_all();
+			});
+	}
+
+	virtual ~decompressing_buffer () {
+		{
+			lock_guard<mutex> guard(lock);
+			stopping = true;
+			changed.notify_all();
+		}
+		reader.join();
+		for (auto& decompressor: decompressors) decompressor.join();
+	}
+
+	/* Decompresses jobs that underflow has not claimed yet, until the reader
+		 has finished and no such jobs are left, or the consumer has stopped. */
+	void decompress_jobs () {
+		while (true) {
+			shared_ptr<decompression_job> job;
+			{
+				unique_lock<mutex> guard(lock);
+				changed.wait(guard, [this, &job]{
+						if (stopping) return true;
+						for (auto& next: jobs) {
+							if (!next->claimed.exchange(true)) {
+								job = next;
+								return true;
+							}
+						}
+						return finished;
+					});
+			}
+			if (job == nullptr) return;
+			decompress(*job);
+		}
+	}
+
+	/* Returns false when the consumer has stopped. */
+	bool submit (const shared_ptr<decompression_job>& job) {
+		unique_lock<mutex> guard(lock);
+		changed.wait(guard, [this]{return (jobs.size() < max_jobs) || stopping;});
+		if (stopping) return false;
+		jobs.push_back(job);
+		changed.notify_all();
+		return true;
+	}
+
+	size_t read (string& buffer, size_t size) {
+		auto position = buffer.size();
+		buffer.resize(position + size);
+		input.read(&buffer[position], size);
+		buffer.resize(position + input.gcount());
+		return input.gcount();
+	}
+
+	void read_gzip_members () {
+		auto job = make_shared<decompression_job>();
+		read(job->compressed, bgzf_header_size);
+		auto header = reinterpret_cast<const unsigned char*>(job->compressed.data());
+		auto is_bgzf = [](const unsigned char* header) {
+			return (header[0] == 0x1f) && (header[1] == 0x8b) && (header[2] == 8) && (header[3] & 4) &&
+				(header[10] == 6) && (header[11] == 0) && (header[12] == 'B') && (header[13] == 'C') && (header[14] == 2) && (header[15] == 0);
+		};
+		if ((job->compressed.size() < bgzf_header_size) || !is_bgzf(header)) {
+			inflate_gzip_members(job->compressed);
+			return;
+		}
+		while (true) {
+			auto begin = job->compressed.size() - bgzf_header_size;
+			header = reinterpret_cast<const unsigned char*>(&job->compressed[begin]);
+			if (!is_bgzf(header)) {
+				throw runtime_error("Corrupt BGZF block header.");
+			}
+			size_t block_size = (header[16] | (header[17] << 8)) + 1;
+			if (block_size < bgzf_header_size + bgzf_footer_size) {
+				throw runtime_error("Corrupt BGZF block header.");
+			}
+			auto rest = block_size - bgzf_header_size;
+			if (read(job->compressed, rest) != rest) {
+				throw runtime_error("Truncated BGZF input.");
+			}
+			job->ends.push_back(job->compressed.size());
+			auto more = read(job->compressed, bgzf_header_size);
+			if ((more == 0) || (job->compressed.size() - more >= decompression_job_size)) {
+				auto next = make_shared<decompression_job>();
+				next->compressed.assign(job->compressed, job->compressed.size() - more, more);
+				job->compressed.resize(job->compressed.size() - more);
+				if (!submit(job)) return;
+				job = next;
+			}
+			if (more == 0) return;
+			if (more < bgzf_header_size) {
+				throw runtime_error("Truncated BGZF input.");
+			}
+		}
+	}
+
+	void inflate_gzip_members (const string& prefix) {
+		z_stream stream{};
+		if (inflateInit2(&stream, 15 + 16) != Z_OK) {
+			throw runtime_error("Cannot initialize zlib.");
+		}
+		unique_ptr<z_stream, int(*)(z_stream*)> cleanup(&stream, inflateEnd);
+		string in = prefix;
+		auto in_member = true;
+		stream.next_in = reinterpret_cast<Bytef*>(&in[0]);
+		stream.avail_in = in.size();
+		while (true) {
+			auto job = make_shared<decompression_job>();
+			job->text = make_input_buffer(decompression_job_size);
+			stream.next_out = reinterpret_cast<Bytef*>(&(*job->text)[0]);
+			stream.avail_out = decompression_job_size;
+			auto at_end = false;
+			while (stream.avail_out > 0) {
+				if (stream.avail_in == 0) {
+					in.clear();
+					if (read(in, decompression_job_size) == 0) {
+						if (in_member) {
+							throw runtime_error("Truncated gzip input.");
+						}
+						at_end = true;
+						break;
+					}
+					stream.next_in = reinterpret_cast<Bytef*>(&in[0]);
+					stream.avail_in = in.size();
+				}
+				if (!in_member) {
+					inflateReset(&stream);
+					in_member = true;
+				}
+				auto result = inflate(&stream, Z_NO_FLUSH);
+				if (result == Z_STREAM_END) {
+					in_member = false;
+				} else if ((result != Z_OK) && (result != Z_BUF_ERROR)) {
+					throw runtime_error("Corrupt gzip input.");
+				}
+			}
+			job->text->resize(decompression_job_size - stream.avail_out);
+			job->claimed = true;
+			job->done = true;
+			if (!submit(job) || at_end) return;
+		}
+	}
+
+#ifdef ELPREP_ZSTD
+	void read_zstd_frames () {
+		auto job = make_shared<decompression_job>();
+		if ((read(job->compressed, 4) != 4) || (job->compressed != "\x28\xb5\x2f\xfd")) {
+			throw runtime_error("Input starts like zstd, but is not.");
+		}
+		size_t begin = 0;
+		auto eof = false;
+		while (true) {
+			if (begin == job->compressed.size()) {
+				if (eof) break;
+			} else {
+				auto size = ZSTD_findFrameCompressedSize(&job->compressed[begin], job->compressed.size() - begin);
+				if (!ZSTD_isError(size)) {
+					begin += size;
+					job->ends.push_back(begin);
+					if (begin >= decompression_job_size) {
+						auto next = make_shared<decompression_job>();
+						next->compressed.assign(job->compressed, begin, string::npos);
+						job->compressed.resize(begin);
+						if (!submit(job)) return;
+						job = next;
+						begin = 0;
+					}
+					continue;
+				}
+				if (eof) {
+					throw runtime_error("Truncated zstd input.");
+				}
+			}
+			eof = read(job->compressed, max(decompression_job_size, job->compressed.size() - begin)) == 0;
+		}
+		if (!job->ends.empty()) submit(job);
+	}
+#else
+	void read_zstd_frames () {
+		throw runtime_error("This elprep was built without zstd support.");
+	}
+#endif
+
+	void decompress (decompression_job& job) {
+		try {
+			if (format == gzip_compression) {
+				bgzf_decompress(job);
+			} else {
+#ifdef ELPREP_ZSTD
+				zstd_decompress(job);
+#endif
+			}
+		} catch (...) {
+			job.error = current_exception();
+		}
+		lock_guard<mutex> guard(lock);
+		job.done = true;
+		changed.notify_all();
+	}
+
+protected:
+	virtual int_type underflow () {
+		while (gptr() == egptr()) {
+			shared_ptr<decompression_job> job;
+			{
+				unique_lock<mutex> guard(lock);
+				changed.wait(guard, [this]{return !jobs.empty() || finished;});
+				if (jobs.empty()) {
+					if (reader_error) rethrow_exception(reader_error);
+					return traits_type::eof();
+				}
+				job = jobs.front();
+				jobs.pop_front();
+				changed.notify_all();
+			}
+			if (!job->claimed.exchange(true)) {
+				decompress(*job);
+			} else {
+				unique_lock<mutex> guard(lock);
+				changed.wait(guard, [&job]{return job->done;});
+			}
+			if (job->error) rethrow_exception(job->error);
+			current = job->text;
+			auto text = &(*current)[0];
+			setg(text, text, text + current->size());
+		}
+		return traits_type::to_int_type(*gptr());
+	}
+};
+
+/* Recognizes the gzip and zstd magic numbers at the start of input, without
+	 consuming anything. Only the bytes of input's first read are looked at,
+	 so that they can all be put back. */
+inline compression_format detect_compression (streambuf& input) {
+	if (input.sgetc() == char_traits<char>::eof()) return uncompressed;
+	auto available = min(input.in_avail(), streamsize(4));
+	unsigned char start[4] = {};
+	for (streamsize i = 0; i < available; ++i) start[i] = input.sbumpc();
+	for (streamsize i = 0; i < available; ++i) input.sungetc();
+	if ((available >= 2) && (start[0] == 0x1f) && (start[1] == 0x8b)) return gzip_compression;
+	if ((available == 4) && (memcmp(start, "\x28\xb5\x2f\xfd", 4) == 0)) return zstd_compression;
+	return uncompressed;
+}
+
+/* An istream over input that decompresses it when it starts with the gzip
+	 or zstd magic number, with the given number of threads. Otherwise it reads input's
+	 own buffer directly. Decompression errors are thrown from reads rather
+	 than setting badbit only. */
+class decompressing_istream : public istream {
+public:
+	compression_format compression;
+	unique_ptr<decompressing_buffer> buffer;
+
+	decompressing_istream (istream& input, int threads) : istream(input.rdbuf()), compression(uncompressed) {
+		compression = detect_compression(*input.rdbuf());
+		if (compression == uncompressed) return;
+		buffer = make_unique<decompressing_buffer>(input, compression, threads);
+		rdbuf(buffer.get());
+		exceptions(badbit);
+	}
+};
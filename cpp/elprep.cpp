@@ -18,54 +18,97 @@
 
 #include <algorithm>
 #include <any>
+#include <atomic>
+#include <cerrno>
 #include <chrono>
+#include <condition_variable>
 #include <deque>
 #include <exception>
 #include <fstream>
 #include <functional>
+#include <future>
 #include <iostream>
 #include <list>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <random>
 #include <set>
 #include <sstream>
+#include <string_view>
+#include <thread>
 #include <typeindex>
 #include <typeinfo>
 #include <unordered_map>
 #include <vector>
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef ELPREP_ZSTD
+#include <zstd.h>
+#endif
+
 // #include <execinfo.h>
 // #include <signal.h>
 
+#define TBB_PREVIEW_LOCAL_OBSERVER 1
+
 #include "tbb/concurrent_hash_map.h"
 #include "tbb/concurrent_queue.h"
 #include "tbb/concurrent_unordered_map.h"
 #include "tbb/concurrent_vector.h"
+#include "tbb/enumerable_thread_specific.h"
+#include "tbb/parallel_for.h"
 #include "tbb/parallel_sort.h"
+#include "tbb/spin_mutex.h"
 #include "tbb/task_arena.h"
 #include "tbb/task_group.h"
 #include "tbb/task_scheduler_init.h"
+#include "tbb/task_scheduler_observer.h"
 
 using namespace std;
 using namespace tbb;
 
+#include "memory_report.cpp"
+#include "batch_arena.cpp"
 #include "string_slice.cpp"
 #include "istream_wrapper.cpp"
+#include "compression.cpp"
 #include "source.cpp"
+#include "hardware_counters.cpp"
+#include "numa.cpp"
 #include "node.cpp"
 #include "pipeline.cpp"
 #include "filters.cpp"
 #include "string_scanner.cpp"
+#include "quality_kernels.cpp"
 #include "sam_types.cpp"
+#include "sam_index.cpp"
 #include "filter_pipeline.cpp"
 #include "simple_filters.cpp"
+#include "reference_genome.cpp"
 #include "mark_duplicates.cpp"
+#include "sharded_mark_duplicates.cpp"
+#include "split.cpp"
+#include "merge.cpp"
 
 template<typename F>
-void timed_run (bool timed, const string& msg, const F& f) {
+void timed_run (bool timed, const string& phase, const F& f) {
+	begin_hardware_counters_phase(phase);
+	begin_memory_phase(phase);
 	if (timed) {
-		cerr << msg;
+		cerr << phase << ".\n";
 		auto start = chrono::steady_clock::now();
 		f();
 		auto end = chrono::steady_clock::now();
@@ -74,30 +117,89 @@ void timed_run (bool timed, const string& msg, const F& f) {
 	} else {
 		f();
 	}
+	end_memory_phase();
+}
+
+/* The arena the pipelines run in, with nr_of_threads threads, or the
+	 default number when nr_of_threads is 0. The input driver and the
+	 sequential output stage each occupy a slot, so an arena always gets at
+	 least 2 threads. Input decompression uses as many threads of its own. */
+unique_ptr<task_arena> make_pipeline_arena (int nr_of_threads) {
+	auto threads = nr_of_threads;
+	if (threads <= 0) threads = this_task_arena::max_concurrency();
+	if (threads < 2) {
+		if (nr_of_threads > 0) cerr << "--nr-of-threads raised to 2.\n";
+		threads = 2;
+	}
+	return make_unique<task_arena>(threads);
+}
+
+/* Returns a file descriptor for positional writes with --parallel-writes,
+	 or -1 when output is to be written as a stream. */
+int open_output (const string& output, bool parallel_writes) {
+	if (!parallel_writes) return -1;
+	auto fd = open_positional_output(output);
+	if (fd < 0) {
+		cerr << "--parallel-writes ignored, the output is not a regular file, or is opened for appending.\n";
+	}
+	return fd;
+}
+
+/* Opens output for stream writes. Reopening /dev/stdout would truncate a
+	 file that the shell opened for appending, so it is opened in append mode,
+	 which for a freshly truncated file or a pipe makes no difference. */
+void open_output_stream (ofstream& fout, const string& output) {
+	fout.open(output, (output == "/dev/stdout") ? (ios::out | ios::app) : ios::out);
+	if (!fout) {
+		throw runtime_error("Cannot open " + output + ".");
+	}
+}
+
+void close_output (int fd, ofstream& fout, const string& output) {
+	if (fd >= 0) {
+		if (close(fd) != 0) {
+			throw runtime_error("Cannot write " + output + ".");
+		}
+	} else {
+		fout.close();
+		if (fout.fail()) {
+			throw runtime_error("Cannot write " + output + ".");
+		}
+	}
 }
 
-void run_best_practices_pipeline_intermediate_sam (istream& input, ostream& output, const string_slice& sorting_order, const vector<header_filter>& filters, const vector<header_filter>& filters2, bool timed) {
+void run_best_practices_pipeline_intermediate_sam (istream& input, ostream& output, const string_slice& sorting_order, const vector<header_filter>& filters, const vector<header_filter>& filters2, const shared_ptr<mark_duplicates_shard>& shard, const shared_ptr<region_query>& regions, bool compact, const string& index_name, compression_format compression, int compression_level, int output_fd, bool timed) {
 	sam filtered_reads;
 	chrono::duration<double> between;
-	timed_run (timed, "Reading SAM into memory and applying filters.\n", [&](){
-			stream_pipeline_input in(input);
-			sam_pipeline_output out(filtered_reads);
-			between = in.run_pipeline(out, filters, sorting_order);
-		});
-	if (timed) {
-		cerr << "Time between phases: " << between.count() << "s.\n";
+	try {
+		timed_run (timed, "Reading SAM into memory and applying filters", [&](){
+				stream_pipeline_input in(input, sam_field_access(all_fields, all_fields), regions);
+				sam_pipeline_output out(filtered_reads, compact);
+				between = in.run_pipeline(out, filters, sorting_order);
+				add_memory_estimate("intermediate sam", filtered_reads.alignments.size() * sizeof(shared_ptr<sam_alignment>));
+			});
+		if (timed) {
+			cerr << "Time between phases: " << between.count() << "s.\n";
+		}
+		if (shard != nullptr) {
+			timed_run (timed, "Exchanging duplicate marking records", [&](){shard->exchange();});
+		}
+	} catch (...) {
+		// other processes would otherwise wait for this one's records
+		if (shard != nullptr) shard->abort();
+		throw;
 	}
-	timed_run (timed, "Write to file.\n", [&](){
+	timed_run (timed, "Write to file", [&](){
 			sam_pipeline_input in(filtered_reads);
-			stream_pipeline_output out(output);
+			stream_pipeline_output out(output, index_name, compression, compression_level, output_fd);
 			in.run_pipeline(out, filters2, (sorting_order == unsorted) ? unsorted : keep);
 		});
 }
 
-void run_best_practices_pipeline (istream& input, ostream& output, const string_slice& sorting_order, const vector<header_filter>& filters, bool timed) {
-	timed_run (timed, "Running pipeline.\n", [&](){
-			stream_pipeline_input in(input);
-			stream_pipeline_output out(output);
+void run_best_practices_pipeline (istream& input, ostream& output, const string_slice& sorting_order, const vector<header_filter>& filters, const sam_field_access& access, const shared_ptr<region_query>& regions, const string& index_name, compression_format compression, int compression_level, int output_fd, bool timed) {
+	timed_run (timed, "Running pipeline", [&](){
+			stream_pipeline_input in(input, access, regions);
+			stream_pipeline_output out(output, index_name, compression, compression_level, output_fd);
 			in.run_pipeline(out, filters, sorting_order);
 		});
 }
@@ -105,11 +207,24 @@ void run_best_practices_pipeline (istream& input, ostream& output, const string_
 void elprep_filter_script (list<string>& args) {
 	auto sorting_order = keep;
 	auto timed = false;
+	auto nr_of_threads = 0;
+	auto compact_intermediate_sam = false;
+	string index_name;
+	auto compression = uncompressed;
+	auto compression_level = -1;
+	auto parallel_writes = false;
+	auto numa = false;
 	header_filter replace_ref_seq_dict_filter = nullptr;
 	header_filter remove_unmapped_reads_filter = nullptr;
+	sam_field_access remove_unmapped_reads_access;
 	header_filter replace_read_group_filter = nullptr;
 	header_filter mark_duplicates_filter = nullptr;
+	shared_ptr<mark_duplicates_shard> shard;
+	shared_ptr<region_query> regions;
+	shared_ptr<reference_genome> genome;
+	auto restore_bases = false;
 	header_filter remove_duplicates_filter = nullptr;
+	header_filter bin_quality_scores_filter = nullptr;
 	auto input = args.front(); args.pop_front();
 	auto output = args.front(); args.pop_front();
 	while (!args.empty()) {
@@ -119,8 +234,10 @@ void elprep_filter_script (list<string>& args) {
 			replace_ref_seq_dict_filter = replace_reference_sequence_dictionary_from_sam_file(ref_seq_dict);
 		} else if (entry == "--filter-unmapped-reads") {
 			remove_unmapped_reads_filter = filter_unmapped_reads;
+			remove_unmapped_reads_access = filter_unmapped_reads_access;
 		} else if (entry == "--filter-unmapped-reads-strict") {
 			remove_unmapped_reads_filter = filter_unmapped_reads_strict;
+			remove_unmapped_reads_access = filter_unmapped_reads_strict_access;
 		} else if (entry == "--replace-read-group") {
 			auto read_group_string = args.front(); args.pop_front();
 			replace_read_group_filter = add_or_replace_read_group(string_scanner(read_group_string).parse_sam_header_line_from_string());
@@ -128,8 +245,16 @@ void elprep_filter_script (list<string>& args) {
 			mark_duplicates_filter = mark_duplicates(false);
 		} else if (entry == "--mark-duplicates-deterministic") {
 			mark_duplicates_filter = mark_duplicates(true);
+		} else if (entry == "--mark-duplicates-sharded") {
+			auto process = stoul(args.front()); args.pop_front();
+			auto nof_processes = stoul(args.front()); args.pop_front();
+			auto path = args.front(); args.pop_front();
+			shard = make_shared<mark_duplicates_shard>(path, process, nof_processes);
+			mark_duplicates_filter = mark_duplicates_sharded(shard);
 		} else if (entry == "--remove-duplicates") {
 			remove_duplicates_filter = filter_duplicate_reads;
+		} else if (entry == "--bin-quality-scores") {
+			bin_quality_scores_filter = bin_quality_scores;
 		} else if (entry == "--sorting-order") {
 			auto so = args.front(); args.pop_front();
 			if (so == "keep") sorting_order = keep;
@@ -139,10 +264,32 @@ void elprep_filter_script (list<string>& args) {
 			else if (so == "coordinate") sorting_order = coordinate;
 			else throw runtime_error("Unknown sorting order.");
 		} else if (entry == "--nr-of-threads") {
-			args.pop_front();
-			// ignore
+			nr_of_threads = stoi(args.front()); args.pop_front();
+		} else if (entry == "--compact-intermediate-sam") {
+			compact_intermediate_sam = true;
+		} else if (entry == "--write-index") {
+			index_name = args.front(); args.pop_front();
+		} else if (entry == "--output-compression") {
+			compression = parse_compression_format(args.front()); args.pop_front();
+		} else if (entry == "--compression-level") {
+			compression_level = stoi(args.front()); args.pop_front();
+		} else if (entry == "--parallel-writes") {
+			parallel_writes = true;
+		} else if ((entry == "--region") || (entry == "--regions-bed")) {
+			if (regions == nullptr) regions = make_shared<region_query>();
+			((entry == "--region") ? regions->regions : regions->bed_files).push_back(args.front()); args.pop_front();
+		} else if (entry == "--reference-T") {
+			genome = make_shared<reference_genome>(args.front()); args.pop_front();
+		} else if (entry == "--restore-bases") {
+			restore_bases = true;
+		} else if (entry == "--numa") {
+			numa = true;
 		} else if (entry == "--timed") {
 			timed = true;
+		} else if (entry == "--hardware-counters") {
+			enable_hardware_counters();
+		} else if (entry == "--memory-report") {
+			memory_report_enabled = true;
 		} else if ((entry == "--filter-non-exact-mapping-reads") ||
 							 (entry == "--filter-non-exact-mapping-reads-strict") ||
 							 (entry == "--filter-non-overlapping-reads") ||
@@ -151,7 +298,6 @@ void elprep_filter_script (list<string>& args) {
 							 (entry == "--clean-sam") ||
 							 (entry == "--profile") ||
 							 (entry == "--reference-t") ||
-							 (entry == "--reference-T") ||
 							 (entry == "--rename-chromosomes")) {
 			throw runtime_error(entry + " not supported");
 		} else {
@@ -159,26 +305,151 @@ void elprep_filter_script (list<string>& args) {
 		}
 	}
 	vector<header_filter> filters, filters2;
-	if (input != "/dev/stdin") {throw runtime_error("filenames not supported yet.\n");}
+	sam_field_access access;
+	if (regions != nullptr) {
+		// regions need a seekable input file with an index
+		if (input == "/dev/stdin") {throw runtime_error("--region and --regions-bed need an indexed input file.\n");}
+		regions->file_name = input;
+		filters.push_back(filter_regions(regions)); access |= filter_regions_access;
+	} else if (input != "/dev/stdin") {throw runtime_error("filenames not supported yet.\n");}
 	if (output != "/dev/stdout") {throw runtime_error("filenames not supported yet.\n");}
-	if (remove_unmapped_reads_filter != nullptr) {filters.push_back(remove_unmapped_reads_filter);}
-	if (replace_ref_seq_dict_filter != nullptr) {filters.push_back(replace_ref_seq_dict_filter);}
-	if (replace_read_group_filter != nullptr) {filters.push_back(replace_read_group_filter);}
-	if ((replace_ref_seq_dict_filter != nullptr) || (mark_duplicates_filter != nullptr) ||
-			(sorting_order == coordinate) || (sorting_order == queryname)) {
-		filters.push_back(add_refid);
-	}
-	if (mark_duplicates_filter != nullptr) {filters.push_back(mark_duplicates_filter);}
-	filters.push_back(filter_optional_reads);
+	if (remove_unmapped_reads_filter != nullptr) {filters.push_back(remove_unmapped_reads_filter); access |= remove_unmapped_reads_access;}
+	if (replace_ref_seq_dict_filter != nullptr) {filters.push_back(replace_ref_seq_dict_filter); access |= replace_reference_sequence_dictionary_access;}
+	if (replace_read_group_filter != nullptr) {filters.push_back(replace_read_group_filter); access |= add_or_replace_read_group_access;}
+	if (mark_duplicates_filter != nullptr) {filters.push_back(mark_duplicates_filter); access |= mark_duplicates_access;}
+	filters.push_back(filter_optional_reads); access |= filter_optional_reads_access;
+	if (genome != nullptr) {
+		// before intermediate SAM compaction, which packs '=' like any other base
+		filters.push_back(reference_bases(genome, restore_bases)); access |= reference_bases_access;
+	} else if (restore_bases) {
+		throw runtime_error("--restore-bases needs --reference-T.");
+	}
 	if (remove_duplicates_filter != nullptr) {filters2.push_back(remove_duplicates_filter);}
+	auto intermediate_sam = (mark_duplicates_filter != nullptr) || (sorting_order == coordinate) || (sorting_order == queryname) ||
+		((replace_ref_seq_dict_filter != nullptr) && (sorting_order == keep));
+	// Binning comes last, so that markdup still scores the original qualities.
+	if (bin_quality_scores_filter != nullptr) {
+		(intermediate_sam ? filters2 : filters).push_back(bin_quality_scores_filter);
+		access |= bin_quality_scores_access;
+	}
+	if (compression_level < 0) compression_level = default_compression_level(compression);
+	auto arena = make_pipeline_arena(nr_of_threads);
+	ifstream fin(input);
+	decompressing_istream din(fin, arena->max_concurrency());
+	if ((regions != nullptr) && (din.compression != uncompressed)) {
+		throw runtime_error("--region and --regions-bed need an uncompressed input file.");
+	}
+	auto output_fd = open_output(output, parallel_writes);
+	ofstream fout;
+	if (output_fd < 0) open_output_stream(fout, output);
+	auto run_pipelines = [&](){
+		// inside the arena, so that the NUMA arenas share its thread count
+		if (numa) enable_numa();
+		if (intermediate_sam) {
+			run_best_practices_pipeline_intermediate_sam(din, fout, sorting_order, filters, filters2, shard, regions, compact_intermediate_sam, index_name, compression, compression_level, output_fd, timed);
+		} else {
+			run_best_practices_pipeline(din, fout, sorting_order, filters, access, regions, index_name, compression, compression_level, output_fd, timed);
+		}
+	};
+	arena->execute(run_pipelines);
+	close_output(output_fd, fout, output);
+	report_hardware_counters(cerr);
+	report_memory(cerr);
+}
+
+void elprep_split_script (list<string>& args) {
+	auto timed = false;
+	auto nr_of_threads = 0;
+	string output_prefix;
+	int64_t contig_group_size = 0;
+	auto input = args.front(); args.pop_front();
+	auto output_path = args.front(); args.pop_front();
+	while (!args.empty()) {
+		auto entry = args.front(); args.pop_front();
+		if (entry == "--output-prefix") {
+			output_prefix = args.front(); args.pop_front();
+		} else if (entry == "--contig-group-size") {
+			contig_group_size = stoll(args.front()); args.pop_front();
+		} else if (entry == "--nr-of-threads") {
+			nr_of_threads = stoi(args.front()); args.pop_front();
+		} else if (entry == "--timed") {
+			timed = true;
+		} else {
+			throw runtime_error("unknown command line option");
+		}
+	}
+	if (output_prefix.empty()) {
+		auto base = input.substr(input.find_last_of('/') + 1);
+		output_prefix = base.substr(0, base.find_last_of('.'));
+	}
+	auto arena = make_pipeline_arena(nr_of_threads);
 	ifstream fin(input);
-	ofstream fout(output);
-	if ((mark_duplicates_filter != nullptr) || (sorting_order == coordinate) || (sorting_order == queryname) ||
-			((replace_ref_seq_dict_filter != nullptr) && (sorting_order == keep))) {
-		run_best_practices_pipeline_intermediate_sam(fin, fout, sorting_order, filters, filters2, timed);
+	if (!fin) {
+		throw runtime_error("Cannot open " + input + ".");
+	}
+	decompressing_istream din(fin, arena->max_concurrency());
+	auto run_split = [&](){
+		timed_run(timed, "Splitting", [&](){split_sam_file(din, output_path, output_prefix, contig_group_size);});
+	};
+	arena->execute(run_split);
+}
+
+/* input is a SAM file, or a directory whose SAM files, which may be compressed, are merged in name order. */
+void elprep_merge_script (list<string>& args) {
+	auto timed = false;
+	auto nr_of_threads = 0;
+	string index_name;
+	auto compression = uncompressed;
+	auto compression_level = -1;
+	auto parallel_writes = false;
+	auto input = args.front(); args.pop_front();
+	auto output = args.front(); args.pop_front();
+	while (!args.empty()) {
+		auto entry = args.front(); args.pop_front();
+		if (entry == "--nr-of-threads") {
+			nr_of_threads = stoi(args.front()); args.pop_front();
+		} else if (entry == "--write-index") {
+			index_name = args.front(); args.pop_front();
+		} else if (entry == "--output-compression") {
+			compression = parse_compression_format(args.front()); args.pop_front();
+		} else if (entry == "--compression-level") {
+			compression_level = stoi(args.front()); args.pop_front();
+		} else if (entry == "--parallel-writes") {
+			parallel_writes = true;
+		} else if (entry == "--timed") {
+			timed = true;
+		} else {
+			throw runtime_error("unknown command line option");
+		}
+	}
+	vector<string> names;
+	if (auto dir = opendir(input.c_str())) {
+		while (auto entry = readdir(dir)) {
+			string name(entry->d_name);
+			for (string suffix: {".sam", ".sam.gz", ".sam.zst"}) {
+				if ((name.size() > suffix.size()) && (name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0)) {
+					names.push_back(input + "/" + name);
+				}
+			}
+		}
+		closedir(dir);
+		sort(names.begin(), names.end());
 	} else {
-		run_best_practices_pipeline(fin, fout, sorting_order, filters, timed);
+		names.push_back(input);
 	}
+	if (names.empty()) {
+		throw runtime_error("No SAM files found in " + input + ".");
+	}
+	if (compression_level < 0) compression_level = default_compression_level(compression);
+	auto arena = make_pipeline_arena(nr_of_threads);
+	auto output_fd = open_output(output, parallel_writes);
+	ofstream fout;
+	if (output_fd < 0) open_output_stream(fout, output);
+	auto run_merge = [&](){
+		timed_run(timed, "Merging", [&](){merge_sam_files(names, fout, index_name, compression, compression_level, output_fd);});
+	};
+	arena->execute(run_merge);
+	close_output(output_fd, fout, output);
 }
 
 /*
@@ -210,11 +481,19 @@ int main (int argc, char* argv[]) {
 		return 1;
 	} else {
 		if (args.front() == "split") {
-			cerr << "split command not implemented yet.\n";
-			return 1;
+			args.pop_front();
+			if (args.size() < 2) {
+				cerr << "Incorrect number of parameters.\n";
+				return 1;
+			}
+			elprep_split_script(args);
 		} else if (args.front() == "merge") {
-			cerr << "merge comand not implemented yet.\n";
-			return 1;
+			args.pop_front();
+			if (args.size() < 2) {
+				cerr << "Incorrect number of parameters.\n";
+				return 1;
+			}
+			elprep_merge_script(args);
 		} else if (args.front() == "filter") {
 			args.pop_front();
 			elprep_filter_script(args);
@@ -19,6 +19,22 @@
 typedef function<bool(const shared_ptr<sam_alignment>&)> alignment_filter;
 typedef function<alignment_filter(const shared_ptr<sam_header>&)> header_filter;
 
+/* The alignment fields a filter reads and writes (sam_field masks), declared
+	 next to each filter. When the filters of a streaming run write nothing,
+	 lines are only parsed as far as the filters need and forwarded raw. */
+class sam_field_access {
+public:
+	uint32_t reads, writes;
+
+	sam_field_access (uint32_t reads = 0, uint32_t writes = 0) : reads(reads), writes(writes) {}
+
+	sam_field_access& operator|= (const sam_field_access& a) {
+		reads |= a.reads;
+		writes |= a.writes;
+		return *this;
+	}
+};
+
 class pipeline_output {
 public:
 	virtual void add_nodes(pipeline& p, const shared_ptr<sam_header>& header, const string_slice& sorting_order) = 0;
@@ -31,11 +47,45 @@ public:
 	virtual ~pipeline_input() {}
 };
 
+/* Writes lines, adding the newlines back. Lines that were adjacent in the
+	 same input buffer are written with a single call. */
+void format_lines (ostream& out, const deque<string_slice>& lines) {
+	const char* run_begin = nullptr;
+	const char* run_end = nullptr;
+	for (auto& line: lines) {
+		if (line.is_null()) {
+			if (run_begin != nullptr) {
+				out.write(run_begin, run_end - run_begin);
+				run_begin = nullptr;
+			}
+			out.put('\n');
+		} else if ((run_begin != nullptr) && (line.begin() == run_end + 1) && (*run_end == '\n')) {
+			run_end = line.end();
+		} else {
+			if (run_begin != nullptr) {
+				out.write(run_begin, run_end - run_begin);
+				out.put('\n');
+			}
+			run_begin = line.begin();
+			run_end = line.end();
+		}
+	}
+	if (run_begin != nullptr) {
+		out.write(run_begin, run_end - run_begin);
+		out.put('\n');
+	}
+}
+
 pair<receiver, finalizer> alignment_to_string(pipeline& p, node_kind kind, int& data_size) {
 	return make_pair([](int seq_no, any data) -> any {
 			try {
-				auto alns = any_cast<shared_ptr<deque<shared_ptr<sam_alignment>>>>(data);
 				auto result = make_shared<stringstream>();
+				if (data.type() == typeid(shared_ptr<deque<string_slice>>)) {
+					// raw lines from filter_lines
+					format_lines(*result, *any_cast<shared_ptr<deque<string_slice>>>(data));
+					return result;
+				}
+				auto alns = any_cast<shared_ptr<deque<shared_ptr<sam_alignment>>>>(data);
 				for (auto& aln: *alns) {
 					aln->format(*result);
 				}
@@ -46,31 +96,224 @@ pair<receiver, finalizer> alignment_to_string(pipeline& p, node_kind kind, int&
 		}, nullptr);
 }
 
-pair<receiver, finalizer> string_to_alignment(pipeline& p, node_kind kind, int& data_size) {
-	return make_pair([](int seq_no, any data) -> any {
+/* A formatted batch for compressed, indexed or positional output. entries
+	 gives the offset of each record in text, and compressed holds text in
+	 the output's compression format, with block_ends as compress_text
+	 returns them. offset is where compressed goes in the output file. */
+class formatted_batch {
+public:
+	stringstream text;
+	vector<index_entry> entries;
+	string compressed;
+	vector<uint64_t> block_ends;
+	uint64_t offset;
+};
+
+/* Formats a batch like alignment_to_string. With references, it also
+	 records where each record starts, parsing raw lines from filter_lines
+	 only as far as the index needs. */
+filter format_batch(const shared_ptr<reference_index>& references) {
+	return receive([references](int seq_no, any data) -> any {
 			try {
-				auto strings = any_cast<shared_ptr<deque<string_slice>>>(data);
-				auto alns = make_shared<deque<shared_ptr<sam_alignment>>>();
-				for (auto& str: *strings) {
-					alns->emplace_back(make_shared<sam_alignment>(str));
+				auto result = make_shared<formatted_batch>();
+				auto& out = result->text;
+				if (data.type() == typeid(shared_ptr<deque<string_slice>>)) {
+					auto& lines = *any_cast<shared_ptr<deque<string_slice>>>(data);
+					if (references == nullptr) {
+						format_lines(out, lines);
+						return result;
+					}
+					sam_alignment aln;
+					for (auto& line: lines) {
+						if (line.is_null()) {
+							out.put('\n');
+							continue;
+						}
+						auto offset = uint64_t(out.tellp());
+						aln.parse(line, *references, flag_field | rname_field | pos_field | cigar_field);
+						result->entries.emplace_back(aln, offset);
+						out.write(line.begin(), line.size());
+						out.put('\n');
+					}
+					return result;
+				}
+				auto alns = any_cast<shared_ptr<deque<shared_ptr<sam_alignment>>>>(data);
+				if (references != nullptr) result->entries.reserve(alns->size());
+				for (auto& aln: *alns) {
+					if (references != nullptr) result->entries.emplace_back(*aln, uint64_t(out.tellp()));
+					aln->format(out);
 				}
-				return alns;
+				return result;
+			} catch (bad_any_cast& ex) {
+				throw runtime_error("unexpected type in format_batch");
+			}
+		});
+}
+
+filter compress_batch(compression_format format, int level) {
+	return receive([format, level](int seq_no, any data) -> any {
+			try {
+				auto batch = any_cast<shared_ptr<formatted_batch>>(data);
+				auto text = batch->text.str();
+				compress_text(format, level, text.data(), text.size(), batch->compressed, batch->block_ends);
+				return data;
+			} catch (bad_any_cast& ex) {
+				throw runtime_error("unexpected type in compress_batch");
+			}
+		});
+}
+
+/* Writes all of data at offset, as pwrite may write less. */
+void write_at(int fd, const char* data, size_t size, uint64_t offset) {
+	while (size > 0) {
+		auto n = pwrite(fd, data, size, offset);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			throw runtime_error(string("Cannot write output: ") + strerror(errno) + ".");
+		}
+		data += n;
+		size -= n;
+		offset += n;
+	}
+}
+
+filter write_batch_at(int fd) {
+	return receive([fd](int seq_no, any data) -> any {
+			try {
+				auto batch = any_cast<shared_ptr<formatted_batch>>(data);
+				write_at(fd, batch->compressed.data(), batch->compressed.size(), batch->offset);
+				return data;
 			} catch (bad_any_cast& ex) {
-				throw runtime_error("unexpected type in string_to_alignment");
+				throw runtime_error("unexpected type in write_batch_at");
+			}
+		});
+}
+
+/* Opens name for positional writes. /dev/stdout is not reopened, which
+	 would truncate a file that the shell opened for appending, but
+	 duplicated, so that output starts at its current offset. Returns -1 if
+	 the output is not a regular file, such as a pipe, which can only be
+	 written in order, or if it is in append mode, where pwrite ignores the
+	 offset. */
+int open_positional_output(const string& name) {
+	auto fd = (name == "/dev/stdout") ? dup(STDOUT_FILENO) : open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		throw runtime_error("Cannot open " + name + ".");
+	}
+	struct stat st;
+	if ((fstat(fd, &st) != 0) || !S_ISREG(st.st_mode) || (fcntl(fd, F_GETFL) & O_APPEND)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Adds the records of a batch with size bytes of text, written at offset,
+	 to the index. */
+void index_batch(csi_index& index, const formatted_batch& batch, uint64_t size, uint64_t offset, compression_format compression) {
+	auto virtual_offset = [&](uint64_t position) -> uint64_t {
+		if (compression == uncompressed) {
+			return (offset + position) << 16;
+		}
+		auto block = position / bgzf_block_size;
+		if (block >= batch.block_ends.size()) {
+			return (offset + batch.compressed.size()) << 16;
+		}
+		auto block_start = (block == 0) ? 0 : batch.block_ends[block - 1];
+		return ((offset + block_start) << 16) | (position % bgzf_block_size);
+	};
+	auto& entries = batch.entries;
+	for (size_t i = 0; i < entries.size(); ++i) {
+		auto end = (i + 1 < entries.size()) ? entries[i + 1].offset : size;
+		index.add(entries[i], virtual_offset(entries[i].offset), virtual_offset(end));
+	}
+}
+
+filter string_to_alignment(const shared_ptr<reference_index>& references) {
+	return [references](pipeline& p, node_kind kind, int& data_size) -> pair<receiver, finalizer> {
+		return make_pair([references](int seq_no, any data) -> any {
+				try {
+					auto strings = any_cast<shared_ptr<deque<string_slice>>>(data);
+					if (!numa_domains.empty()) {
+						strings = localize_lines(*strings);
+					}
+					auto alns = make_shared<deque<shared_ptr<sam_alignment>>>();
+					// The arena lives as long as any alignment of this batch.
+					auto arena = make_shared<batch_arena>();
+					for (auto& str: *strings) {
+						alns->emplace_back(make_arena_alignment(str, *references, arena));
+					}
+					return alns;
+				} catch (bad_any_cast& ex) {
+					throw runtime_error("unexpected type in string_to_alignment");
+				}
+			}, nullptr);
+	};
+}
+
+/* Moves the fields of a batch of alignments into one buffer of exactly the
+	 required size, with 4-bit sequences, so that alignments kept in memory
+	 no longer pin their input buffers. */
+pair<receiver, finalizer> compact_alignments(pipeline& p, node_kind kind, int& data_size) {
+	return make_pair([](int seq_no, any data) -> any {
+			try {
+				auto alns = any_cast<shared_ptr<deque<shared_ptr<sam_alignment>>>>(data);
+				size_t size = 0;
+				for (auto& aln: *alns) size += aln->compact_size();
+				if (size == 0) return data;
+				auto storage = make_input_buffer(size, compact_field_memory);
+				size_t index = 0;
+				for (auto& aln: *alns) aln->compact(storage, index);
+				return data;
+			} catch (bad_any_cast& ex) {
+				throw runtime_error("unexpected type in compact_alignments");
 			}
 		}, nullptr);
 }
 
+/* Applies read-only alignment filters to lines, parsing only the given
+	 fields into one scratch alignment per batch, and passes on the lines
+	 that are kept. */
+filter filter_lines(const shared_ptr<reference_index>& references, const vector<alignment_filter>& aln_filters, uint32_t fields) {
+	return [references, aln_filters, fields](pipeline& p, node_kind kind, int& data_size) -> pair<receiver, finalizer> {
+		if (aln_filters.empty()) return make_pair(nullptr, nullptr);
+		return make_pair([references, aln_filters, fields](int seq_no, any data) -> any {
+				try {
+					auto lines = any_cast<shared_ptr<deque<string_slice>>>(data);
+					auto result = make_shared<deque<string_slice>>();
+					auto aln = make_shared<sam_alignment>();
+					for (auto& line: *lines) {
+						aln->parse(line, *references, fields);
+						auto keep = true;
+						for (auto& f: aln_filters) {
+							if (!f(aln)) {
+								keep = false; break;
+							}
+						}
+						if (keep) result->push_back(line);
+					}
+					return result;
+				} catch (bad_any_cast& ex) {
+					throw runtime_error("unexpected type in filter_lines");
+				}
+			}, nullptr);
+	};
+}
+
 class sam_pipeline_output : public pipeline_output {
 public:
 	sam& output;
+	bool compact;
 
-	sam_pipeline_output(sam& output) : output(output) {}
+	sam_pipeline_output(sam& output, bool compact = false) : output(output), compact(compact) {}
 
 	virtual ~sam_pipeline_output() {}
 
 	virtual void add_nodes(pipeline& p, const shared_ptr<sam_header>& header, const string_slice& sorting_order) {
 		output.header = header;
+		if (compact) {
+			p.nodes.emplace_back(make_shared<parnode>(vector<filter>{compact_alignments}));
+		}
 		if ((sorting_order == keep) || (sorting_order == unknown)) {
 			p.nodes.emplace_back(make_shared<seqnode>(ordered, vector<filter>{to_deque(output.alignments)}));
 		} else if (sorting_order == coordinate) {
@@ -79,7 +322,7 @@ public:
 							}));
 		} else if (sorting_order == queryname) {
 			p.nodes.emplace_back(make_shared<seqnode>(sequential, vector<filter>{
-						to_deque(output.alignments), finalize([this](){parallel_sort(output.alignments, queryname_less);})
+						to_deque(output.alignments), finalize([this](){sort_by_queryname(output.alignments, true);})
 							}));
 		} else if (sorting_order == unsorted) {
 			p.nodes.emplace_back(make_shared<seqnode>(sequential, vector<filter>{
@@ -94,13 +337,23 @@ public:
 class stream_pipeline_output : public pipeline_output {
 public:
 	ostream& output;
+	string index_name;
+	compression_format compression;
+	int compression_level;
+	int positional_fd;
 
-	stream_pipeline_output(ostream& output) : output(output) {}
+	/* With an index_name, the output must be coordinate sorted, and a CSI
+		 index is written to index_name once the output is complete. With a
+		 compression format, each batch is compressed in the parallel stage.
+		 With a positional_fd from open_positional_output, output goes there
+		 instead: the ordered stage only assigns each batch its offset, and
+		 parallel tasks write the batches with pwrite. */
+	stream_pipeline_output(ostream& output, const string& index_name = "", compression_format compression = uncompressed, int compression_level = 0, int positional_fd = -1) :
+		output(output), index_name(index_name), compression(compression), compression_level(compression_level), positional_fd(positional_fd) {}
 
 	virtual ~stream_pipeline_output() {}
 
 	virtual void add_nodes(pipeline& p, const shared_ptr<sam_header>& header, const string_slice& sorting_order) {
-		header->format(output);
 		node_kind kind;
 		if ((sorting_order == keep) || (sorting_order == unknown)) {
 			kind = ordered;
@@ -111,22 +364,115 @@ public:
 		} else {
 			throw runtime_error("Unknown sorting order.");
 		}
+		if (!index_name.empty() || (compression != uncompressed) || (positional_fd >= 0)) {
+			add_batch_nodes(p, header, sorting_order, kind);
+			return;
+		}
+		header->format(output);
 		p.nodes.emplace_back(make_shared<parnode>(vector<filter>{alignment_to_string}));
 		p.nodes.emplace_back(make_shared<seqnode>(kind, vector<filter>{
 					receive([this](int seq_no, any data) -> any {
 							try {
 								auto ss = any_cast<shared_ptr<stringstream>>(data);
-								output << ss->rdbuf();
+								// inserting an empty streambuf sets failbit, which would drop all later batches
+								if (ss->tellp() > 0) output << ss->rdbuf();
+								return data;
+							} catch (bad_any_cast& ex) {
+								throw runtime_error("unexpected type in stream_pipeline_output");
+							}
+						})
+						}));
+	}
+
+	void add_batch_nodes(pipeline& p, const shared_ptr<sam_header>& header, const string_slice& sorting_order, node_kind kind) {
+		shared_ptr<csi_index> index;
+		shared_ptr<reference_index> references;
+		if (!index_name.empty()) {
+			if ((sorting_order != keep) || (header->get_hd_so() != coordinate)) {
+				throw runtime_error("An index can only be written for coordinate-sorted output.");
+			}
+			if (compression == zstd_compression) {
+				throw runtime_error("An index needs uncompressed or gzip output.");
+			}
+			index = make_shared<csi_index>(header->sq);
+			references = make_shared<reference_index>(header->sq);
+		}
+		stringstream header_text;
+		header->format(header_text);
+		auto text = header_text.str();
+		string header_data;
+		vector<uint64_t> header_blocks;
+		compress_text(compression, compression_level, text.data(), text.size(), header_data, header_blocks);
+		uint64_t start = 0;
+		if (positional_fd >= 0) {
+			auto position = lseek(positional_fd, 0, SEEK_CUR);
+			if (position < 0) {
+				throw runtime_error("Cannot determine the output offset.");
+			}
+			start = position;
+			write_at(positional_fd, header_data.data(), header_data.size(), start);
+		} else {
+			output.write(header_data.data(), header_data.size());
+		}
+		auto offset = make_shared<uint64_t>(start + header_data.size());
+		p.nodes.emplace_back(make_shared<parnode>(vector<filter>{format_batch(references)}));
+		if ((compression != uncompressed) || (positional_fd >= 0)) {
+			// for positional writes, this also copies uncompressed text into one buffer
+			p.nodes.emplace_back(make_shared<parnode>(vector<filter>{compress_batch(compression, compression_level)}));
+		}
+		p.nodes.emplace_back(make_shared<seqnode>(kind, vector<filter>{
+					receive_and_finalize([this, offset, index](int seq_no, any data) -> any {
+							try {
+								auto batch = any_cast<shared_ptr<formatted_batch>>(data);
+								auto size = uint64_t(batch->text.tellp());
+								if (index) {
+									index_batch(*index, *batch, size, *offset, compression);
+								}
+								if (positional_fd >= 0) {
+									batch->offset = *offset;
+									*offset += batch->compressed.size();
+								} else if (compression == uncompressed) {
+									if (size > 0) output << batch->text.rdbuf();
+									*offset += size;
+								} else {
+									output.write(batch->compressed.data(), batch->compressed.size());
+									*offset += batch->compressed.size();
+								}
 								return data;
 							} catch (bad_any_cast& ex) {
 								throw runtime_error("unexpected type in stream_pipeline_output");
 							}
+						}, [this, offset, index](){
+							if (compression == gzip_compression) {
+								if (positional_fd >= 0) {
+									write_at(positional_fd, bgzf_eof, sizeof(bgzf_eof), *offset);
+									*offset += sizeof(bgzf_eof);
+								} else {
+									output.write(bgzf_eof, sizeof(bgzf_eof));
+								}
+							}
+							// pwrite leaves the file offset alone, so later writes to
+							// the same file, for example by the shell, go after the output
+							if ((positional_fd >= 0) && (lseek(positional_fd, *offset, SEEK_SET) < 0)) {
+								throw runtime_error("Cannot set the output offset.");
+							}
+							if (index) {
+								ofstream out(index_name, ios::binary);
+								index->write(out);
+								out.close();
+								if (out.fail()) {
+									throw runtime_error("Cannot write " + index_name + ".");
+								}
+							}
 						})
 						}));
+		if (positional_fd >= 0) {
+			p.nodes.emplace_back(make_shared<parnode>(vector<filter>{write_batch_at(positional_fd)}));
+		}
 	}
 };
 
-receiver compose_filters(const shared_ptr<sam_header>& header, const vector<header_filter>& hdr_filters) {
+vector<alignment_filter> compose_alignment_filters(const shared_ptr<sam_header>& header, const vector<header_filter>& hdr_filters) {
 	vector<alignment_filter> aln_filters; aln_filters.reserve(hdr_filters.size());
 	for (auto& f: hdr_filters) {
 		auto aln_filter = f(header);
@@ -134,6 +480,10 @@ receiver compose_filters(const shared_ptr<sam_header>& header, const vector<head
 			aln_filters.push_back(aln_filter);
 		}
 	}
+	return aln_filters;
+}
+
+receiver compose_filters(const vector<alignment_filter>& aln_filters) {
 	if (aln_filters.size() > 0) {
 		return [aln_filters](int seq_no, any data) -> any {
 			auto alns = any_cast<shared_ptr<deque<shared_ptr<sam_alignment>>>>(data);
@@ -193,7 +543,7 @@ public:
 		auto header = input.header;
 		auto& alns = input.alignments;
 		auto original_sorting_order = header->get_hd_so();
-		auto aln_filter = compose_filters(header, hdr_filters);
+		auto aln_filter = compose_filters(compose_alignment_filters(header, hdr_filters));
 		auto sorting_order = effective_sorting_order(so, header, original_sorting_order);
 		auto out = dynamic_cast<sam_pipeline_output*>(&output);
 		if ((out != nullptr) && (tbb::this_task_arena::max_concurrency() <= 3)) {
@@ -206,7 +556,7 @@ public:
 			if (sorting_order == coordinate) {
 				sort(out->output.alignments.begin(), out->output.alignments.end(), coordinate_less);
 			} else if (sorting_order == queryname) {
-				sort(out->output.alignments.begin(), out->output.alignments.end(), queryname_less);
+				sort_by_queryname(out->output.alignments, false);
 			} else if ((sorting_order == keep) ||
 								 (sorting_order == unknown) ||
 								 (sorting_order == unsorted)) {
@@ -230,19 +580,37 @@ public:
 class stream_pipeline_input : public pipeline_input {
 public:
 	istream_wrapper input;
+	sam_field_access access;
+	shared_ptr<region_query> regions;
 
-	stream_pipeline_input(istream& input) : input(input) {}
+	/* With regions, only the parts of the input file that the index lists for
+		 them are read; input is then only used for the header. */
+	stream_pipeline_input(istream& input, const sam_field_access& access = sam_field_access(all_fields, all_fields), const shared_ptr<region_query>& regions = nullptr) :
+		input(input), access(access), regions(regions) {}
 
 	virtual ~stream_pipeline_input() {}
 
 	virtual chrono::duration<double> run_pipeline(pipeline_output& output, const vector<header_filter>& hdr_filters, const string_slice& so) {
 		auto header = make_shared<sam_header>(input);
+		pipeline p;
+		if (regions) {
+			// before compose_alignment_filters, which may replace the dictionary that the index refers to
+			p.src = make_shared<region_source>(regions->file_name, regions->ranges(*header));
+		} else {
+			p.src = make_shared<istream_source>(input);
+		}
 		auto original_sorting_order = header->get_hd_so();
-		auto aln_filter = compose_filters(header, hdr_filters);
+		auto aln_filters = compose_alignment_filters(header, hdr_filters);
 		auto sorting_order = effective_sorting_order(so, header, original_sorting_order);
-		pipeline p;
-		p.src = make_shared<istream_source>(input);
-		p.nodes.emplace_back(make_shared<parnode>(vector<filter>{string_to_alignment}));
+		// after compose_alignment_filters, which may have replaced the dictionary
+		auto references = make_shared<reference_index>(header->sq);
+		if ((access.writes == 0) && (dynamic_cast<stream_pipeline_output*>(&output) != nullptr)) {
+			p.nodes.emplace_back(make_shared<parnode>(vector<filter>{filter_lines(references, aln_filters, access.reads)}));
+			output.add_nodes(p, header, sorting_order);
+			return run(p);
+		}
+		auto aln_filter = compose_filters(aln_filters);
+		p.nodes.emplace_back(make_shared<parnode>(vector<filter>{string_to_alignment(references)}));
 		if (aln_filter) {
 			p.nodes.emplace_back(make_shared<parnode>(vector<filter>{receive(aln_filter)}));
 		}
@@ -16,7 +16,7 @@
 // License and Additional Terms along with this program. If not, see
 // <https://github.com/ExaScience/elprep-bench/blob/master/LICENSE.txt>.
 
-ilter receive(receiver receive) {
+filter receive(receiver receive) {
 	return [=](pipeline& p, node_kind kind, int& data_size) -> pair<receiver, finalizer> {
 		return make_pair(receive, nullptr);
 	};
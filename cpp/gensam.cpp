@@ -0,0 +1,48 @@
+// elprep-bench.
+// Copyright (c) 2018-2023 imec vzw.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version, and Additional Terms
+// (see below).
+
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Affero General Public License for more details.
+
+// You should have received a copy of the GNU Affero General Public
+// License and Additional Terms along with this program. If not, see
+// <https://github.com/ExaScience/elprep-bench/blob/master/LICENSE.txt>.
+
+#include <iostream>
+#include <list>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+#include "synthetic_sam.cpp"
+
+int main (int argc, char* argv[]) {
+	list<string> args;
+	for (auto i = 1; i < argc; ++i) {
+		args.emplace_back(argv[i]);
+	}
+	synthetic_sam_options options;
+	try {
+		while (!args.empty()) {
+			auto entry = args.front(); args.pop_front();
+			if (!parse_synthetic_sam_option(entry, args, options)) {
+				throw runtime_error("unknown command line option " + entry);
+			}
+		}
+	} catch (exception& ex) {
+		cerr << ex.what() << "\nUsage: gensam [options] > output.sam\n" << synthetic_sam_option_help;
+		return 1;
+	}
+	ios_base::sync_with_stdio(false);
+	generate_synthetic_sam(cout, options);
+}
@@ -0,0 +1,201 @@
+// elprep-bench.
+// Copyright (c) 2018-2023 imec vzw.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version, and Additional Terms
+// (see below).
+
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Affero General Public License for more details.
+
+// You should have received a copy of the GNU Affero General Public
+// License and Additional Terms along with this program. If not, see
+// <https://github.com/ExaScience/elprep-bench/blob/master/LICENSE.txt>.
+
+const auto nof_hardware_counters = 4;
+
+const array<pair<uint32_t, uint64_t>, nof_hardware_counters> hardware_counter_events{{
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES}, // last-level cache misses on most CPUs
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES}
+	}};
+
+const array<const char*, nof_hardware_counters> hardware_counter_names{
+	"cycles", "instructions", "LLC misses", "branch misses"
+};
+
+class counter_values {
+public:
+	array<uint64_t, nof_hardware_counters> values;
+
+	counter_values () : values{} {}
+
+	counter_values& operator+= (const counter_values& c) {
+		for (auto i = 0; i < nof_hardware_counters; ++i) values[i] += c.values[i];
+		return *this;
+	}
+};
+
+// Counters that could be opened on the main thread when profiling was enabled.
+// Worker threads only open these, so a missing counter is reported as n/a
+// instead of failing the whole run.
+array<bool, nof_hardware_counters> hardware_counter_available{};
+bool hardware_counters_enabled = false;
+
+inline int open_hardware_counter (int counter) {
+	perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = hardware_counter_events[counter].first;
+	attr.config = hardware_counter_events[counter].second;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	// pid 0, cpu -1: count the calling thread on whatever CPU it runs on.
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+class thread_counters {
+public:
+	array<int, nof_hardware_counters> fds;
+
+	thread_counters () {
+		for (auto i = 0; i < nof_hardware_counters; ++i) {
+			fds[i] = hardware_counter_available[i] ? open_hardware_counter(i) : -1;
+		}
+	}
+
+	~thread_counters () {
+		for (auto fd: fds) {
+			if (fd >= 0) close(fd);
+		}
+	}
+
+	/* Returns running counts, scaled up when the kernel had to multiplex
+		 the counters. */
+	counter_values read_counters () const {
+		counter_values result;
+		for (auto i = 0; i < nof_hardware_counters; ++i) {
+			uint64_t buf[3]; // value, time enabled, time running
+			if ((fds[i] >= 0) && (::read(fds[i], buf, sizeof(buf)) == sizeof(buf)) && (buf[2] > 0)) {
+				result.values[i] = (buf[1] == buf[2]) ? buf[0] : uint64_t(double(buf[0]) * buf[1] / buf[2]);
+			}
+		}
+		return result;
+	}
+};
+
+inline counter_values read_thread_counters () {
+	thread_local thread_counters counters;
+	return counters.read_counters();
+}
+
+inline counter_values operator- (const counter_values& c1, const counter_values& c2) {
+	counter_values result;
+	for (auto i = 0; i < nof_hardware_counters; ++i) {
+		result.values[i] = (c1.values[i] >= c2.values[i]) ? c1.values[i] - c2.values[i] : 0;
+	}
+	return result;
+}
+
+class stage_counters {
+public:
+	string name;
+	mutex m;
+	counter_values total;
+	uint64_t batches;
+
+	stage_counters (const string& name) : name(name), batches(0) {}
+
+	void add (const counter_values& c) {
+		scoped_lock lock(m);
+		total += c;
+		++batches;
+	}
+};
+
+class counter_phase {
+public:
+	string name;
+	vector<shared_ptr<stage_counters>> stages;
+
+	counter_phase (const string& name) : name(name) {}
+};
+
+vector<counter_phase> hardware_counter_phases;
+
+bool enable_hardware_counters () {
+	auto any_available = false;
+	auto error = 0;
+	for (auto i = 0; i < nof_hardware_counters; ++i) {
+		auto fd = open_hardware_counter(i);
+		if (fd >= 0) {
+			close(fd);
+			hardware_counter_available[i] = true;
+			any_available = true;
+		} else {
+			error = errno;
+		}
+	}
+	if (!any_available) {
+		cerr << "Hardware counters not available: " << strerror(error) << ".\n";
+	}
+	hardware_counters_enabled = any_available;
+	return any_available;
+}
+
+inline void begin_hardware_counters_phase (const string& name) {
+	if (hardware_counters_enabled) {
+		hardware_counter_phases.emplace_back(name);
+	}
+}
+
+shared_ptr<stage_counters> add_stage_counters (const string& name) {
+	if (!hardware_counters_enabled || hardware_counter_phases.empty()) return nullptr;
+	auto stage = make_shared<stage_counters>(name);
+	hardware_counter_phases.back().stages.push_back(stage);
+	return stage;
+}
+
+void format_counter_values (ostream& out, const counter_values& c) {
+	for (auto i = 0; i < nof_hardware_counters; ++i) {
+		out << ", " << hardware_counter_names[i] << ": ";
+		if (hardware_counter_available[i]) out << c.values[i]; else out << "n/a";
+	}
+	auto cycles = c.values[0];
+	auto instructions = c.values[1];
+	if (hardware_counter_available[0] && hardware_counter_available[1] && (cycles > 0)) {
+		out << ", IPC: " << double(instructions) / cycles;
+	}
+	if (hardware_counter_available[1] && (instructions > 0)) {
+		for (auto i = 2; i < nof_hardware_counters; ++i) {
+			if (hardware_counter_available[i]) {
+				out << ", " << hardware_counter_names[i] << " per 1000 instructions: " << 1000.0 * c.values[i] / instructions;
+			}
+		}
+	}
+	out << '\n';
+}
+
+void report_hardware_counters (ostream& out) {
+	if (!hardware_counters_enabled) return;
+	out << "Hardware counters (receiver execution only, user space):\n";
+	for (auto& phase: hardware_counter_phases) {
+		out << phase.name << ":\n";
+		counter_values phase_total;
+		uint64_t phase_batches = 0;
+		for (auto& stage: phase.stages) {
+			out << "  " << stage->name << ": batches: " << stage->batches;
+			format_counter_values(out, stage->total);
+			phase_total += stage->total;
+			phase_batches += stage->batches;
+		}
+		out << "  total: batches: " << phase_batches;
+		format_counter_values(out, phase_total);
+	}
+}
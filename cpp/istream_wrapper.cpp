@@ -16,93 +16,166 @@
 // License and Additional Terms along with this program. If not, see
 // <https://github.com/ExaScience/elprep-bench/blob/master/LICENSE.txt>.
 
-const auto istream_wrapper_buffer_size = 65536;
+const size_t istream_wrapper_buffer_size = 1 << 20;
+const size_t istream_wrapper_prefetch = 2;
 
+inline shared_ptr<string> make_input_buffer (size_t size, memory_category category = input_buffer_memory) {
+	if (memory_report_enabled) {
+		auto buffer = new string(size, 0);
+		auto bytes = buffer->capacity();
+		count_allocation(category, bytes);
+		return shared_ptr<string>(buffer, [bytes, category](string* buffer){
+				count_deallocation(category, bytes);
+				delete buffer;
+			});
+	} else {
+		return make_shared<string>(size, 0);
+	}
+}
+
+/* Reads lines from an istream. A dedicated thread reads ahead into a ring
+	 of reusable buffers, so reading overlaps with parsing, and the pipeline
+	 only waits when the input cannot keep up. The thread moves the partial
+	 line at the end of each buffer to the start of the next one, so that
+	 every chunk it hands over ends at a line boundary. A line longer than a
+	 buffer gets a larger one. Lines are slices of the buffers, so a buffer
+	 is only reused once no slice refers to it anymore. */
 class istream_wrapper {
 public:
+	class chunk {
+	public:
+		shared_ptr<string> buffer;
+		size_t size;
+	};
+
 	istream& input;
-	size_t index;
+	size_t index, size;
 	shared_ptr<string> buffer;
 
-	istream_wrapper (istream& input) : input(input), index(0), buffer(make_shared<string>(istream_wrapper_buffer_size, 0)) {
-		input.read(&buffer->operator[](0), istream_wrapper_buffer_size);
-		buffer->resize(input.gcount());
+private:
+	mutex lock;
+	condition_variable changed;
+	deque<chunk> chunks;
+	bool finished, stopping;
+	exception_ptr error;
+	thread reader;
+
+	/* Returns the next buffer of the ring, or a new one if that one is still
+		 in use or too small. */
+	static shared_ptr<string> next_buffer (vector<shared_ptr<string>>& ring, size_t& next, size_t min_size) {
+		auto& slot = ring[next];
+		next = (next + 1) % ring.size();
+		if (!slot || (slot.use_count() > 1) || (slot->size() < min_size)) {
+			slot = make_input_buffer(max(istream_wrapper_buffer_size, min_size));
+		}
+		return slot;
 	}
 
-private:
-	void fill () {
-		auto new_buffer = make_shared<string>(istream_wrapper_buffer_size, 0);
-		auto rest = buffer->size()-index;
-		buffer->copy(&new_buffer->operator[](0), rest, index);
-		input.read(&new_buffer->operator[](rest), index);
-		new_buffer->resize(rest+input.gcount());
+	/* Returns false when the wrapper is being destroyed. */
+	bool deliver (const chunk& c) {
+		unique_lock<mutex> guard(lock);
+		changed.wait(guard, [this]{return (chunks.size() < istream_wrapper_prefetch) || stopping;});
+		if (stopping) return false;
+		chunks.push_back(c);
+		changed.notify_all();
+		return true;
+	}
+
+	void read_ahead () {
+		vector<shared_ptr<string>> ring(istream_wrapper_prefetch + 2);
+		size_t next = 0;
+		shared_ptr<string> previous;
+		size_t previous_end = 0, carry = 0;
+		while (true) {
+			auto current = next_buffer(ring, next, 2 * carry);
+			if (carry > 0) previous->copy(&(*current)[0], carry, previous_end - carry);
+			input.read(&(*current)[carry], current->size() - carry);
+			auto end = carry + size_t(input.gcount());
+			if (end == carry) {
+				if (carry > 0) deliver(chunk{current, carry});
+				return;
+			}
+			auto newline = current->rfind('\n', end - 1);
+			if (newline == string::npos) {
+				carry = end;
+			} else {
+				if (!deliver(chunk{current, newline + 1})) return;
+				carry = end - newline - 1;
+			}
+			previous = current;
+			previous_end = end;
+		}
+	}
+
+	bool fill () {
+		unique_lock<mutex> guard(lock);
+		changed.wait(guard, [this]{return !chunks.empty() || finished;});
+		if (chunks.empty()) {
+			if (error) rethrow_exception(error);
+			index = size = 0;
+			return false;
+		}
+		buffer = chunks.front().buffer;
+		size = chunks.front().size;
 		index = 0;
-		buffer = new_buffer;
+		chunks.pop_front();
+		changed.notify_all();
+		return true;
 	}
 
 public:
-	inline bool eof () {
-		if (index < buffer->size()) {
-			return false;
-		} else {
-			fill();
-			return buffer->size() == 0;
+	istream_wrapper (istream& input) : input(input), index(0), size(0), buffer(make_input_buffer(0)), finished(false), stopping(false) {
+		reader = thread([this](){
+				try {
+					read_ahead();
+				} catch (...) {
+					lock_guard<mutex> guard(lock);
+					error = current_exception();
+				}
+				lock_guard<mutex> guard(lock);
+				finished = true;
+				changed.notify_all();
+			});
+	}
+
+	istream_wrapper (const istream_wrapper&) = delete;
+	istream_wrapper& operator= (const istream_wrapper&) = delete;
+
+	~istream_wrapper () {
+		{
+			lock_guard<mutex> guard(lock);
+			stopping = true;
+			changed.notify_all();
 		}
+		reader.join();
+	}
+
+	inline bool eof () {
+		return (index == size) && !fill();
 	}
 
 	inline char peek () {
-		if (index < buffer->size()) {
-			return buffer->operator[](index);
-		} else {
-			fill();
-			if (buffer->size() > 0) {
-				return buffer->operator[](0);
-			} else {
-				throw runtime_error("peek after eof");
-			}
+		if ((index == size) && !fill()) {
+			throw runtime_error("peek after eof");
 		}
+		return buffer->operator[](index);
 	}
 
 	pair<string_slice, bool> getline () {
-		auto start = index;
-		for (auto end = index; end < buffer->size(); ++end) {
-			if (buffer->operator[](end) == '\n') {
-				index = end+1;
-				return make_pair(string_slice(buffer, start, end-start), true);
-			}
-		}
-		fill();
-		for (auto end = 0; end < buffer->size(); ++end) {
-			if (buffer->operator[](end) == '\n') {
-				index = end+1;
-				return make_pair(string_slice(buffer, 0, end), true);
-			}
-		}
-		index = buffer->size();
-		if (input.eof()) {
-			return make_pair(string_slice(buffer, 0, index), index > 0);
-		} else {
-			throw runtime_error("istream_wrapper::getline: istream_wrapper_buffer_size too small.");
+		if ((index == size) && !fill()) {
+			return make_pair(string_slice(buffer, 0, 0), false);
 		}
+		auto start = index;
+		auto newline = static_cast<const char*>(memchr(&buffer->operator[](index), '\n', size - index));
+		// only the last line of the input can lack a newline
+		auto end = (newline == nullptr) ? size : size_t(newline - &buffer->operator[](0));
+		index = min(end + 1, size);
+		return make_pair(string_slice(buffer, start, end - start), true);
 	}
 
 	void skipline () {
-		for (auto end = index; end < buffer->size(); ++end) {
-			if (buffer->operator[](end) == '\n') {
-				index = end+1;
-				return;
-			}
-		}
-		fill();
-		for (auto end = 0; end < buffer->size(); ++end) {
-			if (buffer->operator[](end) == '\n') {
-				index = end+1;
-				return;
-			}
-		}
-		index = buffer->size();
-		if (!input.eof()) {
-			throw runtime_error("istream_wrapper::skipline: istream_wrapper_buffer_size too small.");
-		}
+		if ((index == size) && !fill()) return;
+		auto newline = static_cast<const char*>(memchr(&buffer->operator[](index), '\n', size - index));
+		index = (newline == nullptr) ? size : size_t(newline - &buffer->operator[](0)) + 1;
 	}
 };
@@ -0,0 +1,2 @@
+g++ -O3 -std=c++17 -lstdc++ -ltbb -lz -pthread microbench.cpp -o microbench
+g++ -O3 -std=c++17 -lstdc++ gensam.cpp -o gensam
@@ -1 +1 @@
-g++ -O3 -std=c++17 -lstdc++ -ltbb -ltbbmalloc -pthread elprep.cpp -o elprep
+g++ -O3 -std=c++17 -lstdc++ -ltbb -ltbbmalloc -lz -pthread elprep.cpp -o elprep
@@ -1 +1 @@
-g++ -O3 -std=c++17 -lstdc++ -ltbb -pthread -ltcmalloc -fno-builtin-malloc -fno-builtin-calloc -fno-builtin-realloc -fno-builtin-free -fno-omit-frame-pointer elprep.cpp -o elprep
+g++ -O3 -std=c++17 -lstdc++ -ltbb -lz -pthread -ltcmalloc -fno-builtin-malloc -fno-builtin-calloc -fno-builtin-realloc -fno-builtin-free -fno-omit-frame-pointer elprep.cpp -o elprep
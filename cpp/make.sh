@@ -1 +1 @@
-g++ -g -std=c++17 -lstdc++ -ltbb -pthread elprep.cpp -o elprep
+g++ -g -std=c++17 -lstdc++ -ltbb -lz -pthread elprep.cpp -o elprep
@@ -16,63 +16,23 @@
 // License and Additional Terms along with this program. If not, see
 // <https://github.com/ExaScience/elprep-bench/blob/master/LICENSE.txt>.
 
-const auto phred_score_table = []() -> array<uint8_t,512> {
-	array<uint8_t,512> table;
-	for (auto c = 0; c < 256; ++c) {
-		auto pos = c << 1;
-		if ((c < 33) || (c > 126)) {
-			table[pos] = 0;
-			table[pos+1] = 1;
-		} else {
-			auto qual = c - 33;
-			table[pos] = (qual >= 15) ? qual : 0;
-			table[pos+1] = 0;
-		}
-	}
-	return table;
-}();
-
 int32_t compute_phred_score (const shared_ptr<sam_alignment>& aln) {
-	int32_t score = 0;
-	int32_t error = 0;
-	for (auto p = aln->qual.begin(); p != aln->qual.end(); ++p) {
-		auto pos = *p << 1;
-		score += phred_score_table[pos];
-		error |= phred_score_table[pos+1];
-	}
-	if (error != 0) {
+	bool valid;
+	auto score = sum_phred_scores(aln->qual.begin(), aln->qual.size(), valid);
+	if (!valid) {
 		throw runtime_error("Invalid QUAL character.");
 	}
 	return score;
 }
 
-const set<char> clipped_table({'S', 'H'});
-const set<char> reference_table({'M', 'D', 'N', '=', 'X'});
-
 int32_t compute_unclipped_position(const shared_ptr<sam_alignment>& aln) {
 	auto& cigar = scan_cigar_string(aln->cigar);
-	if (cigar.size() == 0) {return aln->pos;}
-
-	if (aln->is_reversed()) {
-		int32_t clipped = 1;
-		auto result = aln->pos - 1;
-		for (int i = cigar.size()-1; i >= 0; --i) {
-			auto op = cigar[i];
-			auto p = op.operation;
-			auto c = clipped_table.count(p);
-			auto r = reference_table.count(p);
-			clipped *= c;
-			result += (r|clipped)*op.length;
-		}
-		return result;
+	if (cigar.operations.empty()) {
+		return aln->pos;
+	} else if (aln->is_reversed()) {
+		return aln->pos - 1 + cigar.reference_span + cigar.trailing_clip;
 	} else {
-		auto result = aln->pos;
-		for (auto op: cigar) {
-			auto p = op.operation;
-			if (clipped_table.count(p) == 0) {break;}
-			result -= op.length;
-		}
-		return result;
+		return aln->pos - cigar.leading_clip;
 	}
 }
 
@@ -139,7 +99,7 @@ class fragment_hash {
 public:
 	size_t operator() (const shared_ptr<sam_alignment>& aln) const {
 		return 29 * (tbb_hasher(aln->get_libid()) ^
-								 tbb_hasher(aln->get_refid()) ^
+								 tbb_hasher(aln->refid) ^
 								 tbb_hasher(get_adapted_pos(aln)) ^
 								 tbb_hasher(aln->is_reversed()));
 	}
@@ -149,16 +109,17 @@ class fragment_equal {
 public:
 	bool operator() (const shared_ptr<sam_alignment>& aln1, const shared_ptr<sam_alignment>& aln2) const {
 		return (aln1->get_libid() == aln2->get_libid()) &&
-			(aln1->get_refid() == aln2->get_refid()) &&
+			(aln1->refid == aln2->refid) &&
 			(get_adapted_pos(aln1) == get_adapted_pos(aln2)) &&
 			(aln1->is_reversed() == aln2->is_reversed());
 	}
 };
 
-typedef concurrent_unordered_map<shared_ptr<sam_alignment>, shared_ptr<handle<shared_ptr<sam_alignment>>>, fragment_hash, fragment_equal> fragment_map;
+typedef concurrent_unordered_map<shared_ptr<sam_alignment>, shared_ptr<handle<shared_ptr<sam_alignment>>>, fragment_hash, fragment_equal,
+																 counting_allocator<pair<const shared_ptr<sam_alignment>, shared_ptr<handle<shared_ptr<sam_alignment>>>>, fragment_map_memory>> fragment_map;
 
 void classify_fragment (const shared_ptr<sam_alignment>& aln, fragment_map& fragments, bool deterministic) {
-	auto p = fragments.emplace(aln, make_shared<handle<shared_ptr<sam_alignment>>>(aln));
+	auto p = fragments.emplace(aln, allocate_shared<handle<shared_ptr<sam_alignment>>>(counting_allocator<handle<shared_ptr<sam_alignment>>, fragment_map_memory>(), aln));
 	if (p.second) return;
 	auto best_handle = p.first->second;
 	if (is_true_fragment(aln)) {
@@ -173,7 +134,7 @@ void classify_fragment (const shared_ptr<sam_alignment>& aln, fragment_map& frag
 					aln->flag |= duplicate; break;
 				} else if (best_aln_score == aln_score) {
 					if (deterministic) {
-						if (aln->qname > best->qname) {
+						if (compare_qnames(*aln, *best) > 0) {
 							aln->flag |= duplicate; break;
 						} else if (best_handle->compare_exchange(best, aln)) {
 							best->flag |= duplicate; break;
@@ -201,7 +162,7 @@ void classify_fragment (const shared_ptr<sam_alignment>& aln, fragment_map& frag
 class alignment_pair_hash {
 public:
 	static size_t hash (const shared_ptr<sam_alignment>& aln) {
-		return 29 * (tbb_hasher(aln->get_libid()) ^ tbb_hasher(aln->qname));
+		return 29 * (tbb_hasher(aln->get_libid()) ^ qname_hash(*aln));
 	}
 
 	static bool equal (const shared_ptr<sam_alignment>& aln1, const shared_ptr<sam_alignment>& aln2) {
@@ -209,7 +170,8 @@ public:
 	}
 };
 
-typedef concurrent_hash_map<shared_ptr<sam_alignment>, shared_ptr<sam_alignment>, alignment_pair_hash> pair_fragment_map;
+typedef concurrent_hash_map<shared_ptr<sam_alignment>, shared_ptr<sam_alignment>, alignment_pair_hash,
+														counting_allocator<pair<const shared_ptr<sam_alignment>, shared_ptr<sam_alignment>>, pair_fragment_map_memory>> pair_fragment_map;
 
 class pair_handle {
 public:
@@ -225,8 +187,8 @@ class pair_hash {
 public:
 	size_t operator() (const pair_handle& p) const {
 		return 29 * (tbb_hasher(p.aln1->get_libid()) ^
-								 tbb_hasher(p.aln1->get_refid()) ^
-								 tbb_hasher(p.aln2->get_refid()) ^
+								 tbb_hasher(p.aln1->refid) ^
+								 tbb_hasher(p.aln2->refid) ^
 								 tbb_hasher((int64_t(get_adapted_pos(p.aln1)) << 32) + int64_t(get_adapted_pos(p.aln2))) ^
 								 tbb_hasher(p.aln1->is_reversed()) ^
 								 tbb_hasher(p.aln2->is_reversed()));
@@ -237,16 +199,21 @@ class pair_equal {
 public:
 	bool operator() (const pair_handle& p1, const pair_handle& p2) const {
 		return (p1.aln1->get_libid() == p2.aln1->get_libid()) &&
-			(p1.aln1->get_refid() == p2.aln1->get_refid()) &&
+			(p1.aln1->refid == p2.aln1->refid) &&
 			(get_adapted_pos(p1.aln1) == get_adapted_pos(p2.aln1)) &&
 			(p1.aln1->is_reversed() == p2.aln1->is_reversed()) &&
-			(p1.aln2->get_refid() == p2.aln2->get_refid()) &&
+			(p1.aln2->refid == p2.aln2->refid) &&
 			(get_adapted_pos(p1.aln2) == get_adapted_pos(p2.aln2)) &&
 			(p1.aln2->is_reversed() == p2.aln2->is_reversed());
 	}
 };
 
-typedef concurrent_unordered_map<pair_handle, shared_ptr<handle<shared_ptr<pair_handle>>>, pair_hash, pair_equal> pair_map;
+typedef concurrent_unordered_map<pair_handle, shared_ptr<handle<shared_ptr<pair_handle>>>, pair_hash, pair_equal,
+																 counting_allocator<pair<const pair_handle, shared_ptr<handle<shared_ptr<pair_handle>>>>, pair_map_memory>> pair_map;
+
+inline shared_ptr<pair_handle> make_pair_handle (const pair_handle& p) {
+	return allocate_shared<pair_handle>(counting_allocator<pair_handle, pair_map_memory>(), p);
+}
 
 void classify_pair (const shared_ptr<sam_alignment>& aln, pair_fragment_map& fragments, pair_map& pairs, bool deterministic) {
 	if (!is_true_pair(aln)) return;
@@ -276,13 +243,13 @@ void classify_pair (const shared_ptr<sam_alignment>& aln, pair_fragment_map& fra
 
 	pair_handle pair_key(score, aln1, aln2);
 
-	auto p = pairs.emplace(pair_key, make_shared<handle<shared_ptr<pair_handle>>>(make_shared<pair_handle>(pair_key)));
+	auto p = pairs.emplace(pair_key, allocate_shared<handle<shared_ptr<pair_handle>>>(counting_allocator<handle<shared_ptr<pair_handle>>, pair_map_memory>(), make_pair_handle(pair_key)));
 	if (p.second) return;
 	auto best_handle = p.first->second;
 	shared_ptr<pair_handle> entry = nullptr;
 	auto get_entry = [&](){
 		if (entry == nullptr) {
-			entry = make_shared<pair_handle>(pair_key);
+			entry = make_pair_handle(pair_key);
 		}
 		return entry;
 	};
@@ -294,7 +261,7 @@ void classify_pair (const shared_ptr<sam_alignment>& aln, pair_fragment_map& fra
 			break;
 		} else if (best->score == score) {
 			if (deterministic) {
-				if (aln1->qname > best->aln1->qname) {
+				if (compare_qnames(*aln1, *best->aln1) > 0) {
 					aln1->flag |= duplicate;
 					aln2->flag |= duplicate;
 					break;
@@ -316,6 +283,8 @@ void classify_pair (const shared_ptr<sam_alignment>& aln, pair_fragment_map& fra
 	}
 }
 
+const sam_field_access mark_duplicates_access(all_fields, flag_field);
+
 header_filter mark_duplicates (bool deterministic) {
 	return [deterministic](const shared_ptr<sam_header>& header) -> alignment_filter {
 		auto fragments = make_shared<fragment_map>(1000000);
@@ -0,0 +1,217 @@
+// elprep-bench.
+// Copyright (c) 2018-2023 imec vzw.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version, and Additional Terms
+// (see below).
+
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Affero General Public License for more details.
+
+// You should have received a copy of the GNU Affero General Public
+// License and Additional Terms along with this program. If not, see
+// <https://github.com/ExaScience/elprep-bench/blob/master/LICENSE.txt>.
+
+enum memory_category {
+	input_buffer_memory,
+	alignment_memory,
+	tag_memory,
+	cigar_cache_memory,
+	fragment_map_memory,
+	pair_fragment_map_memory,
+	pair_map_memory,
+	arena_memory,
+	compact_field_memory,
+	nof_memory_categories
+};
+
+const array<const char*, nof_memory_categories> memory_category_names{
+	"input buffers",
+	"alignments",
+	"optional fields and temporaries",
+	"CIGAR cache",
+	"markdup fragments",
+	"markdup pair fragments",
+	"markdup pairs",
+	"batch arenas",
+	"compacted fields"
+};
+
+bool memory_report_enabled = false;
+
+array<atomic<int64_t>, nof_memory_categories> memory_in_use{};
+array<atomic<int64_t>, nof_memory_categories> memory_peak{};
+array<atomic<int64_t>, nof_memory_categories> memory_allocations{};
+
+inline void count_allocation (memory_category c, int64_t bytes) {
+	if (memory_report_enabled) {
+		auto in_use = memory_in_use[c].fetch_add(bytes, memory_order_relaxed) + bytes;
+		memory_allocations[c].fetch_add(1, memory_order_relaxed);
+		auto peak = memory_peak[c].load(memory_order_relaxed);
+		while ((in_use > peak) && !memory_peak[c].compare_exchange_weak(peak, in_use, memory_order_relaxed));
+	}
+}
+
+inline void count_deallocation (memory_category c, int64_t bytes) {
+	if (memory_report_enabled) {
+		memory_in_use[c].fetch_sub(bytes, memory_order_relaxed);
+	}
+}
+
+/* Reads are counted by the pipeline sources, so that paths that never
+	 allocate an alignment per read, and scratch alignments, do not skew the
+	 number. */
+atomic<int64_t> memory_reads{0};
+
+inline void count_reads (int64_t n) {
+	if (memory_report_enabled) {
+		memory_reads.fetch_add(n, memory_order_relaxed);
+	}
+}
+
+/* Allocator that forwards to std::allocator and, when --memory-report is
+	 given, attributes the allocated bytes to a memory_category. Deallocations
+	 of memory allocated before the report was enabled are not an issue,
+	 because the report is enabled while parsing the command line. */
+template<typename T, memory_category C> class counting_allocator {
+public:
+	using value_type = T;
+
+	template<typename U> struct rebind {
+		using other = counting_allocator<U, C>;
+	};
+
+	counting_allocator () noexcept {}
+
+	template<typename U> counting_allocator (const counting_allocator<U, C>&) noexcept {}
+
+	T* allocate (size_t n) {
+		count_allocation(C, n * sizeof(T));
+		return allocator<T>().allocate(n);
+	}
+
+	void deallocate (T* p, size_t n) {
+		count_deallocation(C, n * sizeof(T));
+		allocator<T>().deallocate(p, n);
+	}
+};
+
+template<typename T, typename U, memory_category C>
+inline bool operator== (const counting_allocator<T, C>&, const counting_allocator<U, C>&) {return true;}
+
+template<typename T, typename U, memory_category C>
+inline bool operator!= (const counting_allocator<T, C>&, const counting_allocator<U, C>&) {return false;}
+
+/* Peak RSS per phase relies on Linux's /proc/self/clear_refs, which can
+	 reset the VmHWM high-water mark. When that is not possible, the reported
+	 peak is the peak since process start. */
+bool reset_peak_rss () {
+	ofstream clear_refs("/proc/self/clear_refs");
+	if (!clear_refs) return false;
+	clear_refs << "5";
+	clear_refs.flush();
+	return bool(clear_refs);
+}
+
+int64_t read_peak_rss () {
+	ifstream status("/proc/self/status");
+	string line;
+	while (getline(status, line)) {
+		if (line.compare(0, 6, "VmHWM:") == 0) {
+			return atoll(line.c_str() + 6) * 1024;
+		}
+	}
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return int64_t(usage.ru_maxrss) * 1024;
+}
+
+class memory_phase {
+public:
+	string name;
+	bool peak_rss_reset;
+	int64_t peak_rss;
+	int64_t reads;
+	array<int64_t, nof_memory_categories> in_use, peak;
+	vector<pair<string, int64_t>> estimates;
+
+	memory_phase (const string& name) : name(name), peak_rss_reset(false), peak_rss(0), reads(0), in_use{}, peak{} {}
+};
+
+vector<memory_phase> memory_phases;
+
+inline void begin_memory_phase (const string& name) {
+	if (memory_report_enabled) {
+		memory_phases.emplace_back(name);
+		auto& phase = memory_phases.back();
+		for (auto c = 0; c < nof_memory_categories; ++c) {
+			memory_peak[c].store(memory_in_use[c].load());
+		}
+		phase.reads = memory_reads.load();
+		phase.peak_rss_reset = reset_peak_rss();
+	}
+}
+
+inline void end_memory_phase () {
+	if (memory_report_enabled) {
+		auto& phase = memory_phases.back();
+		phase.peak_rss = read_peak_rss();
+		phase.reads = memory_reads.load() - phase.reads;
+		for (auto c = 0; c < nof_memory_categories; ++c) {
+			phase.in_use[c] = memory_in_use[c].load();
+			phase.peak[c] = memory_peak[c].load();
+		}
+	}
+}
+
+/* For containers that do not go through a counting_allocator, such as the
+	 intermediate sam, callers can add an estimate to the current phase. */
+inline void add_memory_estimate (const string& name, int64_t bytes) {
+	if (memory_report_enabled && !memory_phases.empty()) {
+		memory_phases.back().estimates.emplace_back(name, bytes);
+	}
+}
+
+inline void format_bytes (ostream& out, int64_t bytes) {
+	out << bytes << " bytes (" << double(bytes) / (1024 * 1024) << " MB)";
+}
+
+void report_memory (ostream& out) {
+	if (!memory_report_enabled) return;
+	int64_t reads = 0, peak_rss = 0;
+	out << "Memory report:\n";
+	for (auto& phase: memory_phases) {
+		reads += phase.reads;
+		peak_rss = max(peak_rss, phase.peak_rss);
+		out << phase.name << ":\n  peak RSS" << (phase.peak_rss_reset ? "" : " (since process start)") << ": ";
+		format_bytes(out, phase.peak_rss);
+		out << "\n  reads read: " << phase.reads << '\n';
+		int64_t total = 0;
+		for (auto c = 0; c < nof_memory_categories; ++c) {
+			if ((phase.in_use[c] == 0) && (phase.peak[c] == 0)) continue;
+			out << "  " << memory_category_names[c] << ": in use at end: ";
+			format_bytes(out, phase.in_use[c]);
+			out << ", peak: ";
+			format_bytes(out, phase.peak[c]);
+			out << '\n';
+			// arena blocks hold the alignments and fields already counted above
+			if (c != arena_memory) total += phase.in_use[c];
+		}
+		for (auto& estimate: phase.estimates) {
+			out << "  " << estimate.first << " (estimated): ";
+			format_bytes(out, estimate.second);
+			out << '\n';
+			total += estimate.second;
+		}
+		out << "  tracked total in use at end: ";
+		format_bytes(out, total);
+		out << '\n';
+	}
+	if (reads > 0) {
+		out << "Estimated bytes per read (peak RSS / reads read): " << peak_rss / reads << '\n';
+	}
+}
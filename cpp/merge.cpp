@@ -0,0 +1,233 @@
+// elprep-bench.
+// Copyright (c) 2018-2023 imec vzw.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version, and Additional Terms
+// (see below).
+
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Affero General Public License for more details.
+
+// You should have received a copy of the GNU Affero General Public
+// License and Additional Terms along with this program. If not, see
+// <https://github.com/ExaScience/elprep-bench/blob/master/LICENSE.txt>.
+
+/* elprep merge combines sorted SAM files, such as the filtered partitions of
+	 elprep split, into one sorted file. Every part is parsed ahead by its own
+	 thread, only as far as the sort key, so the merge itself only compares
+	 precomputed keys in a loser tree. The merged lines are formatted and
+	 written by the usual output stages. Copies of spread reads that split
+	 added to contig partitions are normally removed by filter already; any
+	 that are left are dropped here. */
+
+class merge_record {
+public:
+	string_slice line;
+	string_slice qname;
+	qname_key qname_token;
+	uint64_t position; // reference id and position, unmapped reads last
+};
+
+const size_t merge_batch_size = 4096;
+
+class merge_part {
+public:
+	ifstream file;
+	decompressing_istream text;
+	istream_wrapper in;
+	shared_ptr<sam_header> header;
+	vector<merge_record> current, next;
+	size_t index;
+	future<void> reader;
+
+	merge_part (const string& name, int threads) : file(name), text(file, threads), in(text), index(0) {
+		if (!file.is_open()) {
+			throw runtime_error("Cannot open " + name + ".");
+		}
+		header = make_shared<sam_header>(in);
+	}
+
+	~merge_part () {
+		if (reader.valid()) reader.wait();
+	}
+
+	void read_ahead (const shared_ptr<reference_index>& references) {
+		reader = async(launch::async, [this, references](){
+				next.clear();
+				sam_alignment aln;
+				while ((next.size() < merge_batch_size) && !in.eof()) {
+					auto [line, ok] = in.getline();
+					if (!ok) break;
+					if (line.size() == 0) continue;
+					aln.parse(line, *references, qname_field | rname_field | pos_field | tags_field);
+					if (aln.has_tag(sr)) continue;
+					auto refid = (aln.refid < 0) ? uint64_t(0xFFFFFFFF) : uint64_t(aln.refid);
+					next.push_back(merge_record{line, aln.qname, qname_key(), (refid << 32) | uint32_t(aln.pos)});
+					next.back().qname_token.tokenize(aln.qname);
+				}
+			});
+	}
+
+	/* Makes the next batch current. Returns false when the part is exhausted. */
+	bool advance (const shared_ptr<reference_index>& references) {
+		reader.get();
+		swap(current, next);
+		index = 0;
+		if (current.empty()) return false;
+		read_ahead(references);
+		return true;
+	}
+
+	inline const merge_record& head () const {return current[index];}
+};
+
+/* Orders merge_records by the sorting order of the merged file, and by part
+	 for equal keys, so merging is stable. Other sorting orders concatenate the
+	 parts. */
+class merge_order {
+public:
+	enum {by_coordinate, by_queryname, by_part} kind;
+
+	merge_order (const string_slice& sorting_order) :
+		kind((sorting_order == coordinate) ? by_coordinate : (sorting_order == queryname) ? by_queryname : by_part) {}
+
+	inline int compare (const merge_record& r1, const merge_record& r2) const {
+		if (kind == by_coordinate) {
+			return (r1.position < r2.position) ? -1 : (r1.position > r2.position) ? 1 : 0;
+		} else if (kind == by_queryname) {
+			return compare_qnames(r1.qname_token, r1.qname, r2.qname_token, r2.qname);
+		} else {
+			return 0;
+		}
+	}
+};
+
+/* Loser tree over the heads of the parts: tree[0] is the overall winner,
+	 tree[1..k-1] the losers of the inner matches. After the winner advances,
+	 only the matches on its path to the root are replayed. */
+class merge_source : public source {
+public:
+	vector<unique_ptr<merge_part>>& parts;
+	shared_ptr<reference_index> references;
+	merge_order order;
+	vector<bool> active;
+	vector<int> tree;
+	shared_ptr<deque<string_slice>> d;
+
+	inline bool less (int p1, int p2) const {
+		if (!active[p1]) return false;
+		if (!active[p2]) return true;
+		auto c = order.compare(parts[p1]->head(), parts[p2]->head());
+		return (c < 0) || ((c == 0) && (p1 < p2));
+	}
+
+	merge_source (vector<unique_ptr<merge_part>>& parts, const shared_ptr<reference_index>& references, const string_slice& sorting_order) :
+		parts(parts), references(references), order(sorting_order), active(parts.size()), tree(parts.size()) {
+		int k = parts.size();
+		for (auto i = 0; i < k; ++i) {
+			parts[i]->read_ahead(references);
+		}
+		for (auto i = 0; i < k; ++i) {
+			active[i] = parts[i]->advance(references);
+		}
+		vector<int> winners(2 * k);
+		for (auto i = 0; i < k; ++i) winners[k + i] = i;
+		for (auto n = k - 1; n > 0; --n) {
+			auto a = winners[2 * n], b = winners[2 * n + 1];
+			if (less(b, a)) swap(a, b);
+			winners[n] = a;
+			tree[n] = b;
+		}
+		tree[0] = (k > 1) ? winners[1] : 0;
+	}
+
+	virtual ~merge_source() {}
+
+	virtual int prepare() {
+		return -1;
+	}
+
+	virtual int fetch(int n) {
+		int k = parts.size();
+		auto result = make_shared<deque<string_slice>>();
+		auto fetched = 0;
+		for (; (fetched < n) && active[tree[0]]; ++fetched) {
+			auto winner = tree[0];
+			auto& part = *parts[winner];
+			result->push_back(part.head().line);
+			if (++part.index == part.current.size()) {
+				active[winner] = part.advance(references);
+			}
+			for (auto node = (winner + k) / 2; node > 0; node /= 2) {
+				if (less(tree[node], winner)) swap(tree[node], winner);
+			}
+			tree[0] = winner;
+		}
+		d = (fetched == 0) ? nullptr : result;
+		return fetched;
+	}
+
+	virtual any data() {
+		return d;
+	}
+};
+
+/* The reference dictionaries of all parts must agree. Sorting orders must
+	 agree as well. Read groups and programs are combined by ID, and comments
+	 by text. */
+shared_ptr<sam_header> merge_headers (const vector<unique_ptr<merge_part>>& parts) {
+	auto header = parts.front()->header;
+	header->user_records.erase(at_sr);
+	auto so = header->get_hd_so();
+	for (size_t i = 1; i < parts.size(); ++i) {
+		auto& other = *parts[i]->header;
+		if (other.get_hd_so() != so) {
+			throw runtime_error("Sorting orders of the merged files differ.");
+		}
+		if ((other.sq.size() != header->sq.size()) ||
+				!equal(other.sq.begin(), other.sq.end(), header->sq.begin(), [](const string_map& r1, const string_map& r2){
+						return (r1.at(SN) == r2.at(SN)) && (get_sq_ln(r1) == get_sq_ln(r2));
+					})) {
+			throw runtime_error("Reference sequence dictionaries of the merged files differ.");
+		}
+		auto add_by_id = [](vector<string_map>& records, const vector<string_map>& new_records) {
+			for (auto& record: new_records) {
+				auto id = record.find(ID);
+				if ((id == record.end()) || (find(records, [&](const string_map& r){
+								auto it = r.find(ID);
+								return (it != r.end()) && (it->second == id->second);
+							}) < 0)) {
+					records.push_back(record);
+				}
+			}
+		};
+		add_by_id(header->rg, other.rg);
+		add_by_id(header->pg, other.pg);
+		for (auto& comment: other.co) {
+			if (std::find(header->co.begin(), header->co.end(), comment) == header->co.end()) {
+				header->co.push_back(comment);
+			}
+		}
+	}
+	return header;
+}
+
+void merge_sam_files (const vector<string>& names, ostream& output, const string& index_name = "", compression_format compression = uncompressed, int compression_level = 0, int output_fd = -1) {
+	vector<unique_ptr<merge_part>> parts;
+	// the parts share the decompression threads
+	auto threads = max(this_task_arena::max_concurrency() / max(int(names.size()), 1), 1);
+	for (auto& name: names) {
+		parts.push_back(make_unique<merge_part>(name, threads));
+	}
+	auto header = merge_headers(parts);
+	auto references = make_shared<reference_index>(header->sq);
+	pipeline p;
+	p.src = make_shared<merge_source>(parts, references, header->get_hd_so());
+	stream_pipeline_output out(output, index_name, compression, compression_level, output_fd);
+	out.add_nodes(p, header, keep);
+	run(p);
+}
@@ -0,0 +1,291 @@
+// elprep-bench.
+// Copyright (c) 2018-2023 imec vzw.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version, and Additional Terms
+// (see below).
+
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Affero General Public License for more details.
+
+// You should have received a copy of the GNU Affero General Public
+// License and Additional Terms along with this program. If not, see
+// <https://github.com/ExaScience/elprep-bench/blob/master/LICENSE.txt>.
+
+#include <algorithm>
+#include <any>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string_view>
+#include <typeindex>
+#include <typeinfo>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef ELPREP_ZSTD
+#include <zstd.h>
+#endif
+
+// #include <execinfo.h>
+// #include <signal.h>
+
+#define TBB_PREVIEW_LOCAL_OBSERVER 1
+
+#include "tbb/concurrent_hash_map.h"
+#include "tbb/concurrent_queue.h"
+#include "tbb/concurrent_unordered_map.h"
+#include "tbb/concurrent_vector.h"
+#include "tbb/enumerable_thread_specific.h"
+#include "tbb/parallel_for.h"
+#include "tbb/parallel_sort.h"
+#include "tbb/spin_mutex.h"
+#include "tbb/task_arena.h"
+#include "tbb/task_group.h"
+#include "tbb/task_scheduler_init.h"
+#include "tbb/task_scheduler_observer.h"
+
+using namespace std;
+using namespace tbb;
+
+#include "memory_report.cpp"
+#include "batch_arena.cpp"
+#include "string_slice.cpp"
+#include "istream_wrapper.cpp"
+#include "compression.cpp"
+#include "source.cpp"
+#include "hardware_counters.cpp"
+#include "numa.cpp"
+#include "node.cpp"
+#include "pipeline.cpp"
+#include "filters.cpp"
+#include "string_scanner.cpp"
+#include "quality_kernels.cpp"
+#include "sam_types.cpp"
+#include "sam_index.cpp"
+#include "filter_pipeline.cpp"
+#include "simple_filters.cpp"
+#include "mark_duplicates.cpp"
+#include "synthetic_sam.cpp"
+
+/* Offline microbenchmarks for the per-read kernels, on a deterministic
+	 synthetic input (see synthetic_sam.cpp). Each benchmark is repeated and
+	 the median time is reported, together with records/s and input bytes/s
+	 for the bytes the kernel actually looks at. */
+
+class benchmark_input {
+public:
+	shared_ptr<sam_header> header;
+	shared_ptr<deque<string_slice>> lines;
+	int64_t bytes;
+
+	benchmark_input (const synthetic_sam_options& options) : lines(make_shared<deque<string_slice>>()), bytes(0) {
+		stringstream generated;
+		generate_synthetic_sam(generated, options);
+		istream_wrapper input(generated);
+		header = make_shared<sam_header>(input);
+		while (!input.eof()) {
+			auto [line, ok] = input.getline();
+			if (!ok) break;
+			lines->push_back(line);
+			bytes += line.size() + 1;
+		}
+	}
+
+	shared_ptr<deque<shared_ptr<sam_alignment>>> parse () const {
+		pipeline p;
+		int data_size = -1;
+		auto parser = string_to_alignment(make_shared<reference_index>(header->sq))(p, parallel, data_size).first;
+		return any_cast<shared_ptr<deque<shared_ptr<sam_alignment>>>>(parser(0, lines));
+	}
+};
+
+class benchmark_result {
+public:
+	int64_t records, bytes;
+};
+
+volatile int64_t benchmark_sink;
+
+class benchmark_runner {
+public:
+	int repetitions;
+	string only;
+
+	benchmark_runner (int repetitions, const string& only) : repetitions(repetitions), only(only) {
+		cout << left << setw(32) << "benchmark" << right << setw(12) << "records" << setw(12) << "median s"
+				 << setw(16) << "records/s" << setw(12) << "MB/s" << '\n';
+	}
+
+	template<typename Prepare, typename Run>
+	void run (const string& name, const Prepare& prepare, const Run& run) {
+		if (!only.empty() && (name.find(only) == string::npos)) return;
+		vector<double> times;
+		benchmark_result result{0, 0};
+		for (auto i = 0; i < repetitions; ++i) {
+			prepare();
+			auto start = chrono::steady_clock::now();
+			result = run();
+			auto end = chrono::steady_clock::now();
+			times.push_back(chrono::duration<double>(end - start).count());
+		}
+		sort(times.begin(), times.end());
+		auto median = times[times.size() / 2];
+		cout << left << setw(32) << name << right << setw(12) << result.records << setw(12) << fixed << setprecision(4) << median
+				 << setw(16) << setprecision(0) << result.records / median << setw(12) << setprecision(1);
+		if (result.bytes > 0) cout << result.bytes / median / (1024 * 1024); else cout << '-';
+		cout << defaultfloat << '\n';
+	}
+};
+
+void run_benchmarks (const benchmark_input& input, benchmark_runner& runner) {
+	auto nothing = [](){};
+	auto alns = input.parse();
+
+	runner.run("parse sam_alignment", nothing, [&](){
+			auto parsed = input.parse();
+			return benchmark_result{int64_t(parsed->size()), input.bytes};
+		});
+
+	runner.run("format", nothing, [&](){
+			stringstream out;
+			for (auto& aln: *alns) aln->format(out);
+			return benchmark_result{int64_t(alns->size()), int64_t(out.tellp())};
+		});
+
+	runner.run("scan_cigar_string", nothing, [&](){
+			int64_t ops = 0, bytes = 0;
+			for (auto& aln: *alns) {
+				ops += scan_cigar_string(aln->cigar).operations.size();
+				bytes += aln->cigar.size();
+			}
+			benchmark_sink = ops;
+			return benchmark_result{int64_t(alns->size()), bytes};
+		});
+
+	runner.run("compute_unclipped_position", nothing, [&](){
+			int64_t sum = 0, bytes = 0;
+			for (auto& aln: *alns) {
+				sum += compute_unclipped_position(aln);
+				bytes += aln->cigar.size();
+			}
+			benchmark_sink = sum;
+			return benchmark_result{int64_t(alns->size()), bytes};
+		});
+
+	runner.run("compute_phred_score", nothing, [&](){
+			int64_t sum = 0, bytes = 0;
+			for (auto& aln: *alns) {
+				sum += compute_phred_score(aln);
+				bytes += aln->qual.size();
+			}
+			benchmark_sink = sum;
+			return benchmark_result{int64_t(alns->size()), bytes};
+		});
+
+	shared_ptr<deque<shared_ptr<sam_alignment>>> fresh;
+	alignment_filter filter;
+	auto reparse = [&](){
+		filter = nullptr;
+		fresh = input.parse();
+		filter = mark_duplicates(false)(input.header);
+	};
+
+	runner.run("mark_duplicates (sequential)", reparse, [&](){
+			for (auto& aln: *fresh) filter(aln);
+			return benchmark_result{int64_t(fresh->size()), 0};
+		});
+
+	runner.run("mark_duplicates (parallel)", reparse, [&](){
+			auto& v = *fresh;
+			parallel_for(blocked_range<size_t>(0, v.size(), 1024), [&](const blocked_range<size_t>& r){
+					for (auto i = r.begin(); i != r.end(); ++i) filter(v[i]);
+				});
+			return benchmark_result{int64_t(v.size()), 0};
+		});
+
+	deque<shared_ptr<sam_alignment>> copy;
+	auto copy_alns = [&](){copy = *alns;};
+
+	runner.run("coordinate sort (sequential)", copy_alns, [&](){
+			sort(copy.begin(), copy.end(), coordinate_less);
+			return benchmark_result{int64_t(copy.size()), 0};
+		});
+
+	runner.run("coordinate sort (parallel)", copy_alns, [&](){
+			parallel_sort(copy, coordinate_less);
+			return benchmark_result{int64_t(copy.size()), 0};
+		});
+
+	runner.run("queryname sort (sequential)", copy_alns, [&](){
+			sort_by_queryname(copy, false);
+			return benchmark_result{int64_t(copy.size()), 0};
+		});
+
+	runner.run("queryname sort (parallel)", copy_alns, [&](){
+			sort_by_queryname(copy, true);
+			return benchmark_result{int64_t(copy.size()), 0};
+		});
+}
+
+int main (int argc, char* argv[]) {
+	list<string> args;
+	for (auto i = 1; i < argc; ++i) {
+		args.emplace_back(argv[i]);
+	}
+	synthetic_sam_options options;
+	options.nof_reads = 200000;
+	auto repetitions = 5;
+	string only;
+	try {
+		while (!args.empty()) {
+			auto entry = args.front(); args.pop_front();
+			if (parse_synthetic_sam_option(entry, args, options)) {
+				continue;
+			} else if ((entry == "--repetitions") && !args.empty()) {
+				repetitions = max(1, stoi(args.front())); args.pop_front();
+			} else if ((entry == "--only") && !args.empty()) {
+				only = args.front(); args.pop_front();
+			} else {
+				throw runtime_error("unknown command line option " + entry);
+			}
+		}
+	} catch (exception& ex) {
+		cerr << ex.what() << "\nUsage: microbench [--repetitions n] [--only substring] [options]\n"
+				 << "Input options (default 200000 reads):\n" << synthetic_sam_option_help;
+		return 1;
+	}
+	benchmark_input input(options);
+	cout << "Synthetic input: " << input.lines->size() << " reads, " << input.bytes << " bytes.\n";
+	benchmark_runner runner(repetitions, only);
+	run_benchmarks(input, runner);
+}
@@ -41,18 +41,30 @@ pair<vector<receiver>, vector<finalizer>> compose_filters(pipeline& p, node_kind
 
 void feed_forward(pipeline& p, int index, int seq_no, any);
 
-void _feed(pipeline& p, const vector<receiver>& receivers, int index, int seqno, any data) {
-	for (auto& r: receivers) {
-		data = r(seqno, data);
+void _feed(pipeline& p, const vector<receiver>& receivers, stage_counters* counters, int index, int seqno, any data) {
+	if (counters) {
+		auto start = read_thread_counters();
+		for (auto& r: receivers) {
+			data = r(seqno, data);
+		}
+		counters->add(read_thread_counters() - start);
+	} else {
+		for (auto& r: receivers) {
+			data = r(seqno, data);
+		}
 	}
 	feed_forward(p, index, seqno, data);
 }
 
 class node {
 public:
+	shared_ptr<stage_counters> counters;
+
 	virtual ~node() noexcept(false) {};
+	virtual node_kind get_kind() const = 0;
 	virtual bool try_merge(shared_ptr<node> n) = 0;
-	virtual bool begin(pipeline& p, int index, int& data_size) = 0;
+	virtual bool begin(pipeline& p, int& data_size) = 0;
+	virtual void start(pipeline& p, int index) = 0;
 	virtual void feed(pipeline& p, int index, int seqno, any data) = 0;
 	virtual void end() = 0;
 };
@@ -60,6 +72,7 @@ public:
 class parnode : public node {
 public:
 	task_group g;
+	numa_task_group numa_group;
 	vector<filter> filters;
 	vector<receiver> receivers;
 	vector<finalizer> finalizers;
@@ -68,6 +81,8 @@ public:
 
 	virtual ~parnode() {}
 
+	virtual node_kind get_kind() const {return parallel;}
+
 	virtual bool try_merge(shared_ptr<node> n) {
 		auto nxt = dynamic_pointer_cast<parnode>(n);
 		if (nxt) {
@@ -85,16 +100,24 @@ public:
 		return false;
 	}
 
-	virtual bool begin(pipeline& p, int index, int& data_size) {
+	virtual bool begin(pipeline& p, int& data_size) {
 		tie(receivers, finalizers) = compose_filters(p, parallel, data_size, filters);
 		filters.clear();
 		return (receivers.size() > 0) || (finalizers.size() > 0);
 	}
 
+	virtual void start(pipeline& p, int index) {}
+
 	virtual void feed(pipeline& p, int index, int seqno, any data) {
-		g.run([&p, this, index, seqno, data](){
-				_feed(p, receivers, index, seqno, data);
+		if (numa_domains.empty()) {
+			g.run([&p, this, index, seqno, data](){
+					_feed(p, receivers, counters.get(), index, seqno, data);
+				});
+		} else {
+			numa_group.run(*numa_domains[seqno % numa_domains.size()], [&p, this, index, seqno, data](){
+					_feed(p, receivers, counters.get(), index, seqno, data);
 				});
+		}
 	}
 
 	virtual void end() {
@@ -102,6 +125,7 @@ public:
 		if (st != complete) {
 			throw runtime_error("tbb::task_group state not complete after wait");
 		}
+		numa_group.wait();
 		for (auto& f: finalizers) {
 			f();
 		}
@@ -123,6 +147,8 @@ public:
 
 	virtual ~seqnode() {}
 
+	virtual node_kind get_kind() const {return kind;}
+
 	virtual bool try_merge(shared_ptr<node> n) {
 		auto nxt = dynamic_pointer_cast<seqnode>(n);
 		if (nxt) {
@@ -143,55 +169,55 @@ public:
 		return false;
 	}
 
-	virtual bool begin(pipeline& p, int index, int& data_size) {
+	virtual bool begin(pipeline& p, int& data_size) {
 		tie(receivers, finalizers) = compose_filters(p, kind, data_size, filters);
 		filters.clear();
-		auto keep = (receivers.size() > 0) || (finalizers.size() > 0);
-		if (keep) {
-			channel.set_capacity(2 * task_scheduler_init::default_num_threads());
-			switch (kind) {
-			case sequential:
-				g.run([&p, this, index]() {
-						pair<int, any> batch;
-						while (true) {
-							channel.pop(batch);
-							if (batch.first < 0) {
-								break;
-							}
-							_feed(p, receivers, index, batch.first, batch.second);
+		return (receivers.size() > 0) || (finalizers.size() > 0);
+	}
+
+	virtual void start(pipeline& p, int index) {
+		channel.set_capacity(2 * this_task_arena::max_concurrency());
+		switch (kind) {
+		case sequential:
+			g.run([&p, this, index]() {
+					pair<int, any> batch;
+					while (true) {
+						channel.pop(batch);
+						if (batch.first < 0) {
+							break;
 						}
-					});
-				break;
-			case ordered:
-				g.run([&p, this, index]() {
-						unordered_map<int, any> stash;
-						auto run = 0;
-						pair<int, any> batch;
-						while (true) {
-							channel.pop(batch);
-							if (batch.first < 0) {
-								break;
-							} else if (batch.first > run) {
-								stash.insert(batch);
-							} else {
-								_feed(p, receivers, index,  batch.first, batch.second);
-								while (true) {
-									run++;
-									auto entry = stash.find(run);
-									if (entry == stash.end()) {
-										break;
-									}
-									batch = *entry;
-									stash.erase(entry);
-									_feed(p, receivers, index, batch.first, batch.second);
+						_feed(p, receivers, counters.get(), index, batch.first, batch.second);
+					}
+				});
+			break;
+		case ordered:
+			g.run([&p, this, index]() {
+					unordered_map<int, any> stash;
+					auto run = 0;
+					pair<int, any> batch;
+					while (true) {
+						channel.pop(batch);
+						if (batch.first < 0) {
+							break;
+						} else if (batch.first > run) {
+							stash.insert(batch);
+						} else {
+							_feed(p, receivers, counters.get(), index,  batch.first, batch.second);
+							while (true) {
+								run++;
+								auto entry = stash.find(run);
+								if (entry == stash.end()) {
+									break;
 								}
+								batch = *entry;
+								stash.erase(entry);
+								_feed(p, receivers, counters.get(), index, batch.first, batch.second);
 							}
 						}
-					});
-				break;
-			}
+					}
+				});
+			break;
 		}
-		return keep;
 	}
 
 	virtual void feed(pipeline& p, int index, int seqno, any data) {
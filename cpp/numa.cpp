@@ -0,0 +1,180 @@
+// elprep-bench.
+// Copyright (c) 2018-2023 imec vzw.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version, and Additional Terms
+// (see below).
+
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Affero General Public License for more details.
+
+// You should have received a copy of the GNU Affero General Public
+// License and Additional Terms along with this program. If not, see
+// <https://github.com/ExaScience/elprep-bench/blob/master/LICENSE.txt>.
+
+/* Optional NUMA placement (--numa). One task_arena per NUMA node, whose
+	 threads are pinned to that node's CPUs, so memory they first touch is
+	 node-local. Parallel nodes hand out batches round-robin over these
+	 arenas, and the parser copies each input batch into a buffer of its own
+	 before parsing, so alignments never point into the reader's buffers on
+	 another node. */
+
+inline vector<int> parse_cpu_list (const string& list) {
+	// Linux list format, e.g. "0-3,8-11"
+	vector<int> result;
+	istringstream in(list);
+	string range;
+	while (getline(in, range, ',')) {
+		if (range.empty() || !isdigit(range[0])) continue;
+		auto dash = range.find('-');
+		auto first = stoi(range.substr(0, dash));
+		auto last = (dash == string::npos) ? first : stoi(range.substr(dash + 1));
+		for (auto cpu = first; cpu <= last; ++cpu) result.push_back(cpu);
+	}
+	return result;
+}
+
+inline string read_sysfs_line (const string& path) {
+	ifstream in(path);
+	string line;
+	getline(in, line);
+	return line;
+}
+
+/* CPUs per online NUMA node, restricted to the CPUs this process may run
+	 on. Nodes without such CPUs are left out. */
+vector<pair<int, vector<int>>> read_numa_topology () {
+	vector<pair<int, vector<int>>> result;
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return result;
+	for (auto node: parse_cpu_list(read_sysfs_line("/sys/devices/system/node/online"))) {
+		vector<int> cpus;
+		for (auto cpu: parse_cpu_list(read_sysfs_line("/sys/devices/system/node/node" + to_string(node) + "/cpulist"))) {
+			if ((cpu < CPU_SETSIZE) && CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+		}
+		if (!cpus.empty()) result.emplace_back(node, cpus);
+	}
+	return result;
+}
+
+/* Pins the threads of an arena to a node's CPUs while they work in it,
+	 and gives them back their original CPUs when they leave. */
+class numa_pinning_observer : public task_scheduler_observer {
+public:
+	cpu_set_t cpus;
+	enumerable_thread_specific<cpu_set_t> saved_cpus;
+
+	numa_pinning_observer (task_arena& arena, const vector<int>& cpu_list) : task_scheduler_observer(arena) {
+		CPU_ZERO(&cpus);
+		for (auto cpu: cpu_list) CPU_SET(cpu, &cpus);
+		observe(true);
+	}
+
+	virtual ~numa_pinning_observer () {
+		observe(false);
+	}
+
+	virtual void on_scheduler_entry (bool) {
+		auto& saved = saved_cpus.local();
+		if (sched_getaffinity(0, sizeof(saved), &saved) != 0) CPU_ZERO(&saved);
+		sched_setaffinity(0, sizeof(cpus), &cpus);
+	}
+
+	virtual void on_scheduler_exit (bool) {
+		auto& saved = saved_cpus.local();
+		if (CPU_COUNT(&saved) > 0) sched_setaffinity(0, sizeof(saved), &saved);
+	}
+};
+
+class numa_domain {
+public:
+	int node;
+	task_arena arena;
+	unique_ptr<numa_pinning_observer> observer;
+
+	// no slots are reserved for masters: work only enters by enqueue
+	numa_domain (int node, const vector<int>& cpus, int threads) : node(node), arena(threads, 0) {
+		arena.initialize();
+		observer = make_unique<numa_pinning_observer>(arena, cpus);
+	}
+};
+
+vector<unique_ptr<numa_domain>> numa_domains;
+
+bool enable_numa () {
+	auto topology = read_numa_topology();
+	if (topology.size() < 2) {
+		cerr << "--numa ignored: fewer than two NUMA nodes available.\n";
+		return false;
+	}
+	// Split the threads of the current arena (--nr-of-threads) over the
+	// nodes in proportion to their CPUs.
+	size_t total_cpus = 0;
+	for (auto& entry: topology) total_cpus += entry.second.size();
+	size_t threads = this_task_arena::max_concurrency();
+	for (auto& [node, cpus]: topology) {
+		numa_domains.push_back(make_unique<numa_domain>(node, cpus, max(int(threads * cpus.size() / total_cpus), 1)));
+	}
+	return true;
+}
+
+/* Tracks tasks enqueued into the NUMA arenas, which, unlike a task_group,
+	 can be spread over several arenas and waited for from outside them. */
+class numa_task_group {
+public:
+	mutex m;
+	condition_variable done;
+	int64_t pending;
+	exception_ptr error;
+
+	numa_task_group () : pending(0) {}
+
+	template<typename F> void run (numa_domain& domain, const F& f) {
+		{
+			scoped_lock lock(m);
+			++pending;
+		}
+		domain.arena.enqueue([this, f](){
+				exception_ptr e;
+				try {
+					f();
+				} catch (...) {
+					e = current_exception();
+				}
+				scoped_lock lock(m);
+				if (e && !error) error = e;
+				if (--pending == 0) done.notify_all();
+			});
+	}
+
+	void wait () {
+		unique_lock lock(m);
+		done.wait(lock, [this](){return pending == 0;});
+		if (error) {
+			auto e = error;
+			error = nullptr;
+			rethrow_exception(e);
+		}
+	}
+};
+
+/* Copies the lines of a batch into one buffer allocated by the calling
+	 thread, so that it is placed on the calling thread's node. */
+shared_ptr<deque<string_slice>> localize_lines (const deque<string_slice>& lines) {
+	size_t size = 0;
+	for (auto& line: lines) size += line.size();
+	auto buffer = make_input_buffer(size);
+	auto result = make_shared<deque<string_slice>>();
+	size_t index = 0;
+	for (auto& line: lines) {
+		memcpy(&buffer->operator[](index), line.begin(), line.size());
+		result->emplace_back(buffer, index, line.size());
+		index += line.size();
+	}
+	return result;
+}
@@ -29,7 +29,7 @@ int nof_batches(pipeline& p, int n) {
 	if (n < 1) {
 		auto nof_batches = p.nof_batches;
 		if (nof_batches < 1) {
-			nof_batches = 2 * task_scheduler_init::default_num_threads();
+			nof_batches = 2 * this_task_arena::max_concurrency();
 			p.nof_batches = nof_batches;
 		}
 		return nof_batches;
@@ -54,19 +54,32 @@ chrono::duration<double> run(pipeline& p) {
 	auto start = chrono::steady_clock::now();
 	auto data_size = p.src->prepare();
 	auto filtered_size = data_size;
-	for (auto index = 0; index < p.nodes.size();) {
-		if (p.nodes[index]->begin(p, index, filtered_size)) {
+	for (size_t index = 0; index < p.nodes.size();) {
+		if (p.nodes[index]->begin(p, filtered_size)) {
 			index++;
 		} else {
 			p.nodes.erase(p.nodes.begin()+index);
 		}
 	}
+	// merge after begin, because dropping empty nodes can make mergeable
+	// nodes adjacent, but before start, which tells each node its final
+	// index for feed_forward
+	for (size_t index = 0; index + 1 < p.nodes.size();) {
+		if (p.nodes[index]->try_merge(p.nodes[index+1])) {
+			p.nodes.erase(p.nodes.begin()+index+1);
+		} else {
+			index++;
+		}
+	}
+	for (size_t index = 0; index < p.nodes.size(); index++) {
+		p.nodes[index]->start(p, index);
+	}
 	if (p.nodes.size() > 0) {
-		for (auto index = 0; index < p.nodes.size()-1;) {
-			if (p.nodes[index]->try_merge(p.nodes[index+1])) {
-				p.nodes.erase(p.nodes.begin()+index+1);
-			} else {
-				index++;
+		if (hardware_counters_enabled) {
+			const char* kind_names[] = {"ordered", "sequential", "parallel"};
+			for (size_t index = 0; index < p.nodes.size(); index++) {
+				auto& n = p.nodes[index];
+				n->counters = add_stage_counters("node " + to_string(index) + " (" + kind_names[n->get_kind()] + ")");
 			}
 		}
 		if (data_size < 0) {
@@ -96,7 +109,7 @@ chrono::duration<double> run(pipeline& p) {
 
 void feed_forward(pipeline& p, int index, int seq_no, any data) {
 	index++;
-	if (index < p.nodes.size()) {
+	if (size_t(index) < p.nodes.size()) {
 		p.nodes[index]->feed(p, index, seq_no, data);
 	}
 }
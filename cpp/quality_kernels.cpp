@@ -0,0 +1,121 @@
+// elprep-bench.
+// Copyright (c) 2018-2023 imec vzw.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version, and Additional Terms
+// (see below).
+
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Affero General Public License for more details.
+
+// You should have received a copy of the GNU Affero General Public
+// License and Additional Terms along with this program. If not, see
+// <https://github.com/ExaScience/elprep-bench/blob/master/LICENSE.txt>.
+
+/* Kernels over quality strings (phred+33). The SIMD versions process 32 or
+	 16 bytes at a time, depending on whether the build targets AVX2 (e.g.
+	 with -march=native) or only the SSE2 baseline of x86-64; remaining bytes
+	 and other architectures use the scalar loop. */
+
+constexpr bool is_valid_quality (uint8_t c) {return (c >= 33) && (c <= 126);}
+
+/* Sum of the quality values >= 15 of an encoded quality string. Sets valid
+	 to false if any character is outside the printable phred+33 range. */
+inline int32_t sum_phred_scores (const char* qual, size_t n, bool& valid) {
+	auto p = reinterpret_cast<const uint8_t*>(qual);
+	auto end = p + n;
+	int64_t score = 0;
+	auto error = false;
+#if defined(__AVX2__)
+	{
+		const auto low = _mm256_set1_epi8(32), high = _mm256_set1_epi8(127);
+		const auto threshold = _mm256_set1_epi8(33 + 14), offset = _mm256_set1_epi8(33);
+		auto sums = _mm256_setzero_si256(), invalid = _mm256_setzero_si256();
+		for (; p + 32 <= end; p += 32) {
+			auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+			// signed compares: bytes >= 128 are negative, and thus invalid
+			auto ok = _mm256_and_si256(_mm256_cmpgt_epi8(v, low), _mm256_cmpgt_epi8(high, v));
+			invalid = _mm256_or_si256(invalid, _mm256_xor_si256(ok, _mm256_set1_epi8(-1)));
+			auto counted = _mm256_and_si256(ok, _mm256_cmpgt_epi8(v, threshold));
+			auto q = _mm256_and_si256(_mm256_sub_epi8(v, offset), counted);
+			sums = _mm256_add_epi64(sums, _mm256_sad_epu8(q, _mm256_setzero_si256()));
+		}
+		alignas(32) int64_t lanes[4];
+		_mm256_store_si256(reinterpret_cast<__m256i*>(lanes), sums);
+		score += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+		error |= _mm256_movemask_epi8(invalid) != 0;
+	}
+#endif
+#if defined(__SSE2__)
+	{
+		const auto low = _mm_set1_epi8(32), high = _mm_set1_epi8(127);
+		const auto threshold = _mm_set1_epi8(33 + 14), offset = _mm_set1_epi8(33);
+		auto sums = _mm_setzero_si128(), invalid = _mm_setzero_si128();
+		for (; p + 16 <= end; p += 16) {
+			auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+			auto ok = _mm_and_si128(_mm_cmpgt_epi8(v, low), _mm_cmpgt_epi8(high, v));
+			invalid = _mm_or_si128(invalid, _mm_xor_si128(ok, _mm_set1_epi8(-1)));
+			auto counted = _mm_and_si128(ok, _mm_cmpgt_epi8(v, threshold));
+			auto q = _mm_and_si128(_mm_sub_epi8(v, offset), counted);
+			sums = _mm_add_epi64(sums, _mm_sad_epu8(q, _mm_setzero_si128()));
+		}
+		score += _mm_cvtsi128_si64(sums) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(sums, sums));
+		error |= _mm_movemask_epi8(invalid) != 0;
+	}
+#endif
+	for (; p < end; ++p) {
+		auto c = *p;
+		error |= !is_valid_quality(c);
+		score += (c >= 33 + 15) && (c <= 126) ? c - 33 : 0;
+	}
+	valid = !error;
+	return int32_t(score);
+}
+
+/* Illumina 8-level quality binning: 0-1 are kept, then 2-9 -> 6,
+	 10-19 -> 15, 20-24 -> 22, 25-29 -> 27, 30-34 -> 33, 35-39 -> 37,
+	 and 40 and up -> 40. Characters outside phred+33 are left alone. */
+constexpr auto illumina_quality_bins = []() {
+	array<char, 256> table{};
+	for (auto c = 0; c < 256; ++c) {
+		auto q = c - 33;
+		auto binned = char(c);
+		if (!is_valid_quality(c) || (q < 2)) binned = c;
+		else if (q < 10) binned = 33 + 6;
+		else if (q < 20) binned = 33 + 15;
+		else if (q < 25) binned = 33 + 22;
+		else if (q < 30) binned = 33 + 27;
+		else if (q < 35) binned = 33 + 33;
+		else if (q < 40) binned = 33 + 37;
+		else binned = 33 + 40;
+		table[c] = binned;
+	}
+	return table;
+}();
+
+inline void bin_quality_string (char* qual, size_t n) {
+	auto p = qual, end = qual + n;
+#if defined(__SSE2__)
+	// bin = 6 + sum of the steps for each threshold reached, see the table above
+	const array<pair<char, char>, 6> steps{{{33 + 10, 9}, {33 + 20, 7}, {33 + 25, 5}, {33 + 30, 6}, {33 + 35, 4}, {33 + 40, 3}}};
+	const auto high = _mm_set1_epi8(127);
+	for (; p + 16 <= end; p += 16) {
+		auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+		auto bin = _mm_set1_epi8(33 + 6);
+		for (auto& step: steps) {
+			auto reached = _mm_cmpgt_epi8(v, _mm_set1_epi8(step.first - 1));
+			bin = _mm_add_epi8(bin, _mm_and_si128(reached, _mm_set1_epi8(step.second)));
+		}
+		auto binned = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(33 + 1)), _mm_cmpgt_epi8(high, v));
+		v = _mm_or_si128(_mm_and_si128(binned, bin), _mm_andnot_si128(binned, v));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(p), v);
+	}
+#endif
+	for (; p < end; ++p) {
+		*p = illumina_quality_bins[uint8_t(*p)];
+	}
+}
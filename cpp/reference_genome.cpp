@@ -0,0 +1,144 @@
+// elprep-bench.
+// Copyright (c) 2018-2023 imec vzw.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version, and Additional Terms
+// (see below).
+
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Affero General Public License for more details.
+
+// You should have received a copy of the GNU Affero General Public
+// License and Additional Terms along with this program. If not, see
+// <https://github.com/ExaScience/elprep-bench/blob/master/LICENSE.txt>.
+
+/* A reference FASTA file with its .fai index, mapped read-only into memory,
+	 so that all threads share one copy and only the pages that reads touch
+	 are loaded. */
+class reference_genome {
+public:
+	class contig {
+	public:
+		int64_t length, offset;
+		int64_t line_bases, line_width;
+	};
+
+	const char* data;
+	size_t size;
+	unordered_map<string, contig> contigs;
+
+	reference_genome (const string& fasta) {
+		ifstream fai(fasta + ".fai");
+		if (!fai.is_open()) {
+			throw runtime_error("Cannot open " + fasta + ".fai.");
+		}
+		string line;
+		while (getline(fai, line)) {
+			istringstream fields(line);
+			string name;
+			contig c;
+			if (!(fields >> name >> c.length >> c.offset >> c.line_bases >> c.line_width) || (c.line_bases <= 0)) {
+				throw runtime_error("Invalid line in " + fasta + ".fai: " + line);
+			}
+			contigs.emplace(name, c);
+		}
+		auto fd = open(fasta.c_str(), O_RDONLY);
+		if (fd < 0) {
+			throw runtime_error("Cannot open " + fasta + ".");
+		}
+		struct stat st;
+		auto mapped = (fstat(fd, &st) == 0) ? mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+		close(fd);
+		if (mapped == MAP_FAILED) {
+			throw runtime_error("Cannot map " + fasta + ".");
+		}
+		data = static_cast<const char*>(mapped);
+		size = st.st_size;
+		for (auto& [name, c]: contigs) {
+			if ((c.length > 0) && (address(c, c.length - 1) >= data + size)) {
+				throw runtime_error(fasta + ".fai does not match " + fasta + ".");
+			}
+		}
+	}
+
+	reference_genome (const reference_genome&) = delete;
+	reference_genome& operator= (const reference_genome&) = delete;
+
+	~reference_genome () {
+		munmap(const_cast<char*>(data), size);
+	}
+
+	inline const char* address (const contig& c, int64_t pos) const {
+		return data + c.offset + pos / c.line_bases * c.line_width + pos % c.line_bases;
+	}
+};
+
+const sam_field_access reference_bases_access(flag_field | rname_field | pos_field | cigar_field | seq_field, seq_field);
+
+/* Writes read bases that equal the reference base they are aligned to as
+	 '=', which the SAM format allows, so that compressed output only has to
+	 store the differences. With restore, turns '=' back into the reference
+	 base. Bases are replaced in place. Lowercase read bases and N are kept,
+	 and so are reads on contigs that the reference does not have. */
+header_filter reference_bases (const shared_ptr<reference_genome>& genome, bool restore) {
+	return [genome, restore](const shared_ptr<sam_header>& header) -> alignment_filter {
+		auto contigs = make_shared<vector<const reference_genome::contig*>>();
+		for (auto& record: header->sq) {
+			auto sn = record.at(SN);
+			string name(sn.begin(), sn.size());
+			auto it = genome->contigs.find(name);
+			if (it == genome->contigs.end()) {
+				contigs->push_back(nullptr);
+			} else if (it->second.length != get_sq_ln(record)) {
+				throw runtime_error("Length of " + name + " differs between the reference and the header.");
+			} else {
+				contigs->push_back(&it->second);
+			}
+		}
+		return [genome, contigs, restore](const shared_ptr<sam_alignment>& aln) -> bool {
+			if (aln->is_unmapped() || (aln->refid < 0) || (aln->seq == star) || (aln->cigar == star)) return true;
+			auto contig = (*contigs)[aln->refid];
+			if (contig == nullptr) return true;
+			auto seq = aln->seq.begin();
+			int64_t length = aln->seq.size(), i = 0;
+			int64_t pos = aln->pos - 1;
+			for (auto& op: scan_cigar_string(aln->cigar).operations) {
+				switch (op.operation) {
+				case 'M': case '=': case 'X': {
+					auto n = min(int64_t(op.length), min(length - i, contig->length - pos));
+					if (n <= 0) return true;
+					auto p = genome->address(*contig, pos);
+					auto column = pos % contig->line_bases;
+					for (auto end = i + n; i < end; ++i) {
+						auto base = char(toupper(*p));
+						if (restore) {
+							if (seq[i] == '=') seq[i] = base;
+						} else if ((seq[i] == base) && (base != 'N')) {
+							seq[i] = '=';
+						}
+						if (++column == contig->line_bases) {
+							column = 0;
+							p += contig->line_width - contig->line_bases + 1;
+						} else {
+							++p;
+						}
+					}
+					pos += n;
+					break;
+				}
+				case 'I': case 'S':
+					i += op.length;
+					break;
+				case 'D': case 'N':
+					pos += op.length;
+					break;
+				}
+			}
+			return true;
+		};
+	};
+}
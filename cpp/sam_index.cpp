@@ -0,0 +1,469 @@
+// elprep-bench.
+// Copyright (c) 2018-2023 imec vzw.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version, and Additional Terms
+// (see below).
+
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Affero General Public License for more details.
+
+// You should have received a copy of the GNU Affero General Public
+// License and Additional Terms along with this program. If not, see
+// <https://github.com/ExaScience/elprep-bench/blob/master/LICENSE.txt>.
+
+/* A CSI index of coordinate-sorted output, built while the output is
+	 written, so that no second pass over the file is needed. The layout is
+	 the one of htslib: a binning index with min_shift 14 and as many levels
+	 as the longest reference needs, a linear index that gives the bins
+	 their loffset, and a pseudo-bin with per-reference metadata. CSI rather
+	 than BAI, because it also covers references longer than 512 Mbp.
+
+	 Offsets are virtual offsets. For BGZF output, they are the offset of a
+	 compressed block shifted left by 16 bits, plus the offset within the
+	 uncompressed block. For uncompressed output, they are the byte offset
+	 shifted left by 16 bits, which is how htslib addresses a file that is
+	 not BGZF-compressed. */
+
+const int32_t csi_min_shift = 14;
+
+/* Number of levels below the root bin, as htslib chooses it. */
+int32_t csi_depth (const vector<string_map>& sq) {
+	int64_t max_length = 0;
+	for (auto& record: sq) {
+		max_length = max(max_length, int64_t(get_sq_ln(record)));
+	}
+	max_length += 256;
+	int32_t depth = 0;
+	for (auto size = int64_t(1) << csi_min_shift; max_length > size; size <<= 3) ++depth;
+	return depth;
+}
+
+inline uint32_t csi_first_bin (int32_t level) {
+	return ((1 << (3 * level)) - 1) / 7;
+}
+
+inline uint32_t csi_meta_bin (int32_t depth) {
+	return csi_first_bin(depth + 1) + 1;
+}
+
+/* Smallest bin that contains [beg, end). */
+inline uint32_t csi_reg2bin (int64_t beg, int64_t end, int32_t depth) {
+	--end;
+	auto s = csi_min_shift;
+	for (auto level = depth; level > 0; --level, s += 3) {
+		if ((beg >> s) == (end >> s)) return csi_first_bin(level) + (beg >> s);
+	}
+	return 0;
+}
+
+/* First linear index window of a bin. */
+inline uint64_t csi_bin_window (uint32_t bin, int32_t depth) {
+	int32_t level = 0;
+	for (auto b = bin; b != 0; b = (b - 1) >> 3) ++level;
+	return uint64_t(bin - csi_first_bin(level)) << (3 * (depth - level));
+}
+
+/* What the index needs to know about an output record. The offset is
+	 relative to the start of the record's batch. */
+class index_entry {
+public:
+	int32_t refid;
+	int64_t beg, end;
+	bool mapped;
+	uint64_t offset;
+
+	index_entry (const sam_alignment& aln, uint64_t offset) :
+		refid(aln.refid), beg(aln.pos - 1), mapped(!aln.is_unmapped()), offset(offset) {
+		int64_t span = 0;
+		if (mapped && (aln.cigar != star)) {
+			span = scan_cigar_string(aln.cigar).reference_span;
+		}
+		end = beg + max(span, int64_t(1));
+	}
+};
+
+class csi_index {
+public:
+	class chunk {
+	public:
+		uint64_t begin, end;
+	};
+
+	class reference {
+	public:
+		map<uint32_t, vector<chunk>> bins;
+		vector<uint64_t> linear;
+		uint64_t begin, end, nof_mapped, nof_unmapped;
+
+		reference () : begin(numeric_limits<uint64_t>::max()), end(0), nof_mapped(0), nof_unmapped(0) {}
+	};
+
+	int32_t depth;
+	vector<reference> references;
+	uint64_t nof_no_coordinate;
+	int32_t last_refid;
+	int64_t last_beg;
+	uint32_t last_bin;
+
+	csi_index (const vector<string_map>& sq) :
+		depth(csi_depth(sq)), references(sq.size()), nof_no_coordinate(0), last_refid(-1), last_beg(-1), last_bin(0) {}
+
+	/* Records must be added in output order, with their virtual begin and end
+		 offsets. */
+	void add (const index_entry& entry, uint64_t begin, uint64_t end) {
+		if (entry.refid < 0) {
+			++nof_no_coordinate;
+			last_refid = numeric_limits<int32_t>::max();
+			return;
+		}
+		if ((entry.refid < last_refid) || ((entry.refid == last_refid) && (entry.beg < last_beg))) {
+			throw runtime_error("Output is not coordinate sorted, cannot write an index.");
+		}
+		auto& ref = references.at(entry.refid);
+		auto bin = csi_reg2bin(entry.beg, entry.end, depth);
+		auto& chunks = ref.bins[bin];
+		// consecutive records in the same bin share a chunk
+		if ((entry.refid == last_refid) && (bin == last_bin) && !chunks.empty() && (chunks.back().end == begin)) {
+			chunks.back().end = end;
+		} else {
+			chunks.push_back(chunk{begin, end});
+		}
+		if (entry.mapped) {
+			auto last_window = uint64_t(entry.end - 1) >> csi_min_shift;
+			if (ref.linear.size() <= last_window) {
+				ref.linear.resize(last_window + 1, numeric_limits<uint64_t>::max());
+			}
+			for (auto window = uint64_t(entry.beg) >> csi_min_shift; window <= last_window; ++window) {
+				if (ref.linear[window] == numeric_limits<uint64_t>::max()) ref.linear[window] = begin;
+			}
+			++ref.nof_mapped;
+		} else {
+			++ref.nof_unmapped;
+		}
+		ref.begin = min(ref.begin, begin);
+		ref.end = end;
+		last_refid = entry.refid;
+		last_beg = entry.beg;
+		last_bin = bin;
+	}
+
+	void write (ostream& out) const {
+		auto put32 = [&out](uint32_t value) {
+			char bytes[4];
+			for (auto i = 0; i < 4; ++i) bytes[i] = char(value >> (8 * i));
+			out.write(bytes, 4);
+		};
+		auto put64 = [&out](uint64_t value) {
+			char bytes[8];
+			for (auto i = 0; i < 8; ++i) bytes[i] = char(value >> (8 * i));
+			out.write(bytes, 8);
+		};
+		out.write("CSI\1", 4);
+		put32(csi_min_shift);
+		put32(depth);
+		put32(0); // no auxiliary data
+		put32(references.size());
+		for (auto& ref: references) {
+			if (ref.nof_mapped + ref.nof_unmapped == 0) {
+				put32(0);
+				continue;
+			}
+			// windows that no record overlaps point at the previous record
+			auto linear = ref.linear;
+			auto previous = ref.begin;
+			for (auto& offset: linear) {
+				if (offset == numeric_limits<uint64_t>::max()) offset = previous;
+				previous = offset;
+			}
+			put32(ref.bins.size() + 1);
+			for (auto& [bin, chunks]: ref.bins) {
+				auto window = csi_bin_window(bin, depth);
+				put32(bin);
+				put64((window < linear.size()) ? linear[window] : 0);
+				put32(chunks.size());
+				for (auto& c: chunks) {
+					put64(c.begin);
+					put64(c.end);
+				}
+			}
+			put32(csi_meta_bin(depth));
+			put64(0);
+			put32(2);
+			put64(ref.begin);
+			put64(ref.end);
+			put64(ref.nof_mapped);
+			put64(ref.nof_unmapped);
+		}
+		put64(nof_no_coordinate);
+	}
+};
+
+/* A CSI index read back from a file, for region queries. */
+class csi_index_file {
+public:
+	class bin {
+	public:
+		uint64_t loffset;
+		vector<csi_index::chunk> chunks;
+	};
+
+	int32_t depth;
+	vector<unordered_map<uint32_t, bin>> references;
+
+	csi_index_file (const string& name) {
+		ifstream in(name, ios::binary);
+		if (!in.is_open()) {
+			throw runtime_error("Cannot open " + name + ".");
+		}
+		string data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+		size_t index = 0;
+		auto get = [&](size_t size) -> uint64_t {
+			if (index + size > data.size()) {
+				throw runtime_error("Truncated index " + name + ".");
+			}
+			uint64_t value = 0;
+			for (size_t i = 0; i < size; ++i) value |= uint64_t(uint8_t(data[index + i])) << (8 * i);
+			index += size;
+			return value;
+		};
+		if (data.compare(0, 4, "CSI\1") != 0) {
+			throw runtime_error(name + " is not a CSI index.");
+		}
+		index = 4;
+		if (int32_t(get(4)) != csi_min_shift) {
+			throw runtime_error("Unsupported minimum shift in " + name + ".");
+		}
+		depth = get(4);
+		index += get(4); // auxiliary data
+		references.resize(get(4));
+		for (auto& ref: references) {
+			for (auto n = get(4); n > 0; --n) {
+				auto& b = ref[get(4)];
+				b.loffset = get(8);
+				b.chunks.resize(get(4));
+				for (auto& c: b.chunks) {
+					c.begin = get(8);
+					c.end = get(8);
+				}
+			}
+		}
+	}
+
+	/* Adds the chunks that may contain records overlapping [beg, end). */
+	void query (int32_t refid, int64_t beg, int64_t end, vector<csi_index::chunk>& chunks) const {
+		if ((refid < 0) || (size_t(refid) >= references.size())) return;
+		auto& bins = references[refid];
+		// records before the loffset of the smallest bin containing beg end before beg
+		uint64_t min_offset = 0;
+		for (auto b = csi_first_bin(depth) + uint32_t(beg >> csi_min_shift); true; b = (b - 1) >> 3) {
+			auto it = bins.find(b);
+			if (it != bins.end()) {
+				min_offset = it->second.loffset;
+				break;
+			}
+			if (b == 0) break;
+		}
+		--end;
+		auto s = csi_min_shift + 3 * depth;
+		for (auto level = 0; level <= depth; ++level, s -= 3) {
+			auto first = csi_first_bin(level);
+			for (auto b = first + (beg >> s); b <= first + (end >> s); ++b) {
+				auto it = bins.find(b);
+				if (it == bins.end()) continue;
+				for (auto& c: it->second.chunks) {
+					if (c.end > min_offset) chunks.push_back(c);
+				}
+			}
+		}
+	}
+};
+
+/* A region of a reference, 0-based and half-open. */
+class genomic_region {
+public:
+	string contig;
+	int32_t refid;
+	int64_t beg, end;
+};
+
+/* Regions that restrict a run to the parts of an indexed input file that
+	 overlap them. Regions are given like samtools does, as contig,
+	 contig:beg or contig:beg-end with 1-based inclusive positions, or as
+	 BED files. The index is the input file's name with .csi appended. */
+class region_query {
+public:
+	string file_name;
+	vector<string> regions;
+	vector<string> bed_files;
+
+	vector<genomic_region> resolve (const sam_header& header) const {
+		reference_index references(header.sq);
+		vector<genomic_region> result;
+		auto add = [&](const string& contig, int64_t beg, int64_t end) {
+			auto refid = references.find(string_slice(contig));
+			if (refid < 0) {
+				throw runtime_error("Unknown contig " + contig + " in a region.");
+			}
+			end = min(end, int64_t(get_sq_ln(header.sq[refid])));
+			if (beg < end) result.push_back(genomic_region{contig, refid, beg, end});
+		};
+		for (auto& region: regions) {
+			// contig names may contain ':'
+			auto colon = region.rfind(':');
+			if ((colon == string::npos) || (references.find(string_slice(region)) >= 0)) {
+				add(region, 0, numeric_limits<int64_t>::max());
+				continue;
+			}
+			string range;
+			for (auto c: region.substr(colon + 1)) if (c != ',') range.push_back(c);
+			auto dash = range.find('-');
+			int64_t beg = stoll(range.substr(0, dash)) - 1;
+			int64_t end = (dash == string::npos) ? numeric_limits<int64_t>::max() : stoll(range.substr(dash + 1));
+			add(region.substr(0, colon), max(beg, int64_t(0)), end);
+		}
+		for (auto& name: bed_files) {
+			ifstream bed(name);
+			if (!bed.is_open()) {
+				throw runtime_error("Cannot open " + name + ".");
+			}
+			string line;
+			while (getline(bed, line)) {
+				if (line.empty() || (line[0] == '#') || (line.compare(0, 5, "track") == 0) || (line.compare(0, 7, "browser") == 0)) continue;
+				istringstream fields(line);
+				string contig;
+				int64_t beg, end;
+				if (!(fields >> contig >> beg >> end)) {
+					throw runtime_error("Invalid line in " + name + ": " + line);
+				}
+				add(contig, beg, end);
+			}
+		}
+		return result;
+	}
+
+	/* The byte ranges of the input file that the regions need, in file order,
+		 without overlaps. */
+	vector<csi_index::chunk> ranges (const sam_header& header) const {
+		csi_index_file index(file_name + ".csi");
+		vector<csi_index::chunk> chunks;
+		for (auto& region: resolve(header)) {
+			index.query(region.refid, region.beg, region.end, chunks);
+		}
+		sort(chunks.begin(), chunks.end(), [](const csi_index::chunk& c1, const csi_index::chunk& c2){return c1.begin < c2.begin;});
+		vector<csi_index::chunk> result;
+		for (auto& c: chunks) {
+			if (((c.begin | c.end) & 0xFFFF) != 0) {
+				throw runtime_error("Region queries need the index of an uncompressed SAM file.");
+			}
+			csi_index::chunk range{c.begin >> 16, c.end >> 16};
+			if (!result.empty() && (range.begin <= result.back().end)) {
+				result.back().end = max(result.back().end, range.end);
+			} else {
+				result.push_back(range);
+			}
+		}
+		return result;
+	}
+};
+
+/* Reads the given byte ranges of a file in order, and splits them into
+	 lines. The ranges start and end at line boundaries. A thread reads the
+	 next block while the pipeline works on the current one. It is not a TBB
+	 task, because waiting for a task in fetch can run pipeline tasks that
+	 block on the output stage, which then never gets more input. */
+class region_source : public source {
+public:
+	ifstream file;
+	vector<csi_index::chunk> ranges;
+	size_t range;
+	uint64_t position;
+	shared_ptr<string> buffer, next;
+	size_t index;
+	future<void> reader;
+	shared_ptr<deque<string_slice>> d;
+
+	region_source (const string& name, const vector<csi_index::chunk>& ranges) :
+		file(name, ios::binary), ranges(ranges), range(0), position(0), buffer(make_input_buffer(0)), index(0) {
+		if (!file.is_open()) {
+			throw runtime_error("Cannot open " + name + ".");
+		}
+		read_ahead();
+	}
+
+	virtual ~region_source() {
+		if (reader.valid()) reader.wait();
+	}
+
+	void read_ahead () {
+		reader = async(launch::async, [this](){
+				next = make_input_buffer(istream_wrapper_buffer_size);
+				size_t size = 0;
+				while ((size < next->size()) && (range < ranges.size())) {
+					auto& r = ranges[range];
+					if (position < r.begin) {
+						position = r.begin;
+						file.seekg(position);
+					}
+					auto n = min(uint64_t(next->size() - size), r.end - position);
+					file.read(&(*next)[size], n);
+					if (uint64_t(file.gcount()) != n) {
+						throw runtime_error("Indexed file is shorter than its index.");
+					}
+					size += n;
+					position += n;
+					if (position == r.end) ++range;
+				}
+				next->resize(size);
+			});
+	}
+
+	virtual int prepare() {
+		return -1;
+	}
+
+	virtual int fetch(int n) {
+		auto result = make_shared<deque<string_slice>>();
+		auto fetched = 0;
+		while (fetched < n) {
+			auto newline = buffer->find('\n', index);
+			if (newline != string::npos) {
+				result->emplace_back(buffer, index, newline - index);
+				index = newline + 1;
+				++fetched;
+				continue;
+			}
+			if (reader.valid()) reader.get();
+			auto rest = buffer->size() - index;
+			if (next->empty()) {
+				if (rest > 0) {
+					result->emplace_back(buffer, index, rest);
+					index = buffer->size();
+					++fetched;
+				}
+				break;
+			}
+			if (rest == 0) {
+				buffer = next;
+			} else {
+				auto joined = make_input_buffer(rest + next->size());
+				buffer->copy(&(*joined)[0], rest, index);
+				next->copy(&(*joined)[rest], next->size());
+				buffer = joined;
+			}
+			index = 0;
+			read_ahead();
+		}
+		d = (fetched == 0) ? nullptr : result;
+		count_reads(fetched);
+		return fetched;
+	}
+
+	virtual any data() {
+		return d;
+	}
+};
@@ -130,7 +130,7 @@ public:
 
 	inline void set_hd_so(const string_slice& value) {
 		hd.erase(GO);
-		hd.insert({SO, value});
+		hd[SO] = value;
 	}
 
 	inline string_slice get_hd_go () const {
@@ -144,7 +144,7 @@ public:
 
 	inline void set_hd_go(const string_slice& value) {
 		hd.erase(SO);
-		hd.insert({GO, value});
+		hd[GO] = value;
 	}
 
 	inline void add_user_record(const string_slice& code, const string_map& record) {
@@ -166,16 +166,74 @@ public:
 };
 
 const string_slice LN("LN");
+const string_slice SN("SN");
 
 inline int32_t get_sq_ln(const string_map& record) {
 	auto it = record.find(LN);
 	if (it == record.end()) {
 		return 0x7FFFFFFF;
 	} else {
-		return atoi(&it->second[0]);
+		return parse_integer(it->second);
 	}
 }
 
+/* Immutable index from reference sequence names to their position in the
+	 @SQ records, built once per pipeline and shared by all parser tasks.
+	 Open addressing with linear probing over a power-of-two table; the names
+	 are copied, so the index does not keep any input buffers alive. */
+class reference_index {
+public:
+	vector<string> names;
+	vector<int32_t> slots;
+	size_t mask;
+
+	static inline size_t hash (const char* p, size_t n) {
+		uint64_t h = 14695981039346656037ULL;
+		for (size_t i = 0; i < n; ++i) {
+			h = (h ^ uint8_t(p[i])) * 1099511628211ULL;
+		}
+		return h ^ (h >> 29);
+	}
+
+	reference_index (const vector<string_map>& sq) {
+		size_t size = 16;
+		while (size < 2 * sq.size()) size *= 2;
+		slots.assign(size, -1);
+		mask = size - 1;
+		names.reserve(sq.size());
+		for (auto& record: sq) {
+			auto it = record.find(SN);
+			if (it == record.end()) {
+				throw runtime_error("SN not found.");
+			}
+			auto& name = it->second;
+			int32_t id = names.size();
+			names.emplace_back(name.begin(), name.size());
+			for (auto i = hash(name.begin(), name.size()) & mask; true; i = (i + 1) & mask) {
+				if (slots[i] < 0) {
+					slots[i] = id;
+					break;
+				} else if (names[slots[i]] == names[id]) {
+					break; // keep the first of duplicate names
+				}
+			}
+		}
+	}
+
+	/* Returns -1 for names that are not in the dictionary, including "*". */
+	inline int32_t find (const string_slice& name) const {
+		auto n = name.size();
+		if (n == 0) return -1;
+		auto p = name.begin();
+		for (auto i = hash(p, n) & mask; true; i = (i + 1) & mask) {
+			auto id = slots[i];
+			if (id < 0) return -1;
+			auto& candidate = names[id];
+			if ((candidate.size() == size_t(n)) && (memcmp(candidate.data(), p, n) == 0)) return id;
+		}
+	}
+};
+
 const unordered_map<std::type_index, function<void(ostream& out, const any& value)>> optional_field_output_table({
 		{type_index(typeid(char)), [](ostream& out, const any& value){out << ":A:" << any_cast<char>(value);}},
 		{type_index(typeid(int32_t)), [](ostream& out, const any& value){out << ":i:" << any_cast<int32_t>(value);}},
@@ -254,68 +312,74 @@ public:
 	}
 };
 
-sam_value parse_sam_char(const string_slice& tag, string_scanner& sc) {
-	return sam_value(tag, sc.read_byte_until('\t').first);
-}
-
-sam_value parse_sam_integer(const string_slice& tag, string_scanner& sc) {
-	return sam_value(tag, atoi(sc.read_until('\t').begin()));
-}
-
-sam_value parse_sam_float(const string_slice& tag, string_scanner& sc) {
-	return sam_value(tag, float(atof(sc.read_until('\t').begin())));
-}
-
-sam_value parse_sam_string(const string_slice& tag, string_scanner& sc) {
-	return sam_value(tag, sc.read_until('\t'));
-}
-
-sam_value parse_sam_byte_array(const string_slice& tag, string_scanner& sc) {
-	auto slice = sc.read_until('\t');
-	deque<uint8_t> result;
-	for (auto p = slice.begin(); p != slice.end(); p += 2) {
-		result.push_back(stoi(string(p, 2), nullptr, 16));
+constexpr auto hex_digit_values = []() {
+	array<int8_t, 256> table{};
+	for (auto c = 0; c < 256; ++c) {
+		table[c] = ((c >= '0') && (c <= '9')) ? c - '0' :
+			((c >= 'a') && (c <= 'f')) ? c - 'a' + 10 :
+			((c >= 'A') && (c <= 'F')) ? c - 'A' + 10 : -1;
 	}
-	return sam_value(tag, result);
-}
+	return table;
+}();
 
-template<typename T, typename F> sam_value _parse_sam_numeric_array(const string_slice& tag, string_scanner& sc, F f) {
+template<typename T> sam_value parse_sam_numeric_array(const string_slice& tag, string_scanner& sc) {
 	vector<T> result; result.reserve(8);
 	while (true) {
 		auto res = sc.read_until(',', '\t');
-		result.push_back(f(res.first.begin()));
+		if constexpr (is_floating_point_v<T>) {
+			result.push_back(atof(res.first.begin()));
+		} else {
+			result.push_back(T(parse_integer(res.first)));
+		}
 		if (res.second != ',') break;
 	}
 	return sam_value(tag, result);
 }
 
-sam_value parse_sam_numeric_array(const string_slice& tag, string_scanner& sc) {
-	auto [ntype, success] = sc.read_byte_until(',');
-	if (!success) {
-		throw runtime_error("Missing entry in numeric array.");
-	}
-	switch (ntype) {
-		case 'c': return _parse_sam_numeric_array<int8_t>(tag, sc, atoi);
-		case 'C': return _parse_sam_numeric_array<uint8_t>(tag, sc, atoi);
-		case 's': return _parse_sam_numeric_array<int16_t>(tag, sc, atoi);
-		case 'S': return _parse_sam_numeric_array<uint16_t>(tag, sc, atoi);
-		case 'i': return _parse_sam_numeric_array<int32_t>(tag, sc, atoi);
-		case 'I': return _parse_sam_numeric_array<uint32_t>(tag, sc, atoi);
-		case 'f': return _parse_sam_numeric_array<float>(tag, sc, atof);
-		default:
-			throw runtime_error("Invalid numeric array type.");
+/* One decoder per SAM field type, selected at compile time, so that each
+	 instantiation is straight-line code for its type. */
+template<char type> sam_value parse_sam_field(const string_slice& tag, string_scanner& sc) {
+	if constexpr (type == 'A') {
+		return sam_value(tag, sc.read_byte_until('\t').first);
+	} else if constexpr (type == 'i') {
+		return sam_value(tag, int32_t(parse_integer(sc.read_until('\t'))));
+	} else if constexpr (type == 'f') {
+		return sam_value(tag, float(atof(sc.read_until('\t').begin())));
+	} else if constexpr (type == 'Z') {
+		return sam_value(tag, sc.read_until('\t'));
+	} else if constexpr (type == 'H') {
+		auto slice = sc.read_until('\t');
+		if (slice.size() % 2 != 0) {
+			throw runtime_error("Odd number of hex digits in byte array.");
+		}
+		deque<uint8_t> result;
+		for (auto p = slice.begin(); p + 1 < slice.end(); p += 2) {
+			auto high = hex_digit_values[uint8_t(p[0])], low = hex_digit_values[uint8_t(p[1])];
+			if ((high < 0) || (low < 0)) {
+				throw runtime_error("Invalid hex digit in byte array.");
+			}
+			result.push_back((high << 4) | low);
+		}
+		return sam_value(tag, result);
+	} else if constexpr (type == 'B') {
+		auto [ntype, success] = sc.read_byte_until(',');
+		if (!success) {
+			throw runtime_error("Missing entry in numeric array.");
+		}
+		switch (ntype) {
+			case 'c': return parse_sam_numeric_array<int8_t>(tag, sc);
+			case 'C': return parse_sam_numeric_array<uint8_t>(tag, sc);
+			case 's': return parse_sam_numeric_array<int16_t>(tag, sc);
+			case 'S': return parse_sam_numeric_array<uint16_t>(tag, sc);
+			case 'i': return parse_sam_numeric_array<int32_t>(tag, sc);
+			case 'I': return parse_sam_numeric_array<uint32_t>(tag, sc);
+			case 'f': return parse_sam_numeric_array<float>(tag, sc);
+			default:
+				throw runtime_error("Invalid numeric array type.");
+		}
 	}
 }
 
-const unordered_map<char, function<sam_value(const string_slice&, string_scanner&)>> optional_field_parse_table({
-		{'A', parse_sam_char},
-		{'i', parse_sam_integer},
-		{'f', parse_sam_float},
-		{'Z', parse_sam_string},
-		{'H', parse_sam_byte_array},
-		{'B', parse_sam_numeric_array}
-	});
-
 sam_value parse_sam_alignment_field (string_scanner& sc) {
 	auto tag = sc.read_until(':');
 	if (tag.size() != 2) {
@@ -325,10 +389,19 @@ sam_value parse_sam_alignment_field (string_scanner& sc) {
 	if (!success) {
 		throw runtime_error("Invalid field type in SAM alignment line.");
 	}
-	return optional_field_parse_table.at(typebyte)(tag, sc);
+	switch (typebyte) {
+		case 'A': return parse_sam_field<'A'>(tag, sc);
+		case 'i': return parse_sam_field<'i'>(tag, sc);
+		case 'f': return parse_sam_field<'f'>(tag, sc);
+		case 'Z': return parse_sam_field<'Z'>(tag, sc);
+		case 'H': return parse_sam_field<'H'>(tag, sc);
+		case 'B': return parse_sam_field<'B'>(tag, sc);
+		default:
+			throw runtime_error("Invalid field type in SAM alignment line.");
+	}
 }
 
-using sam_vector = vector<sam_value>;
+using sam_vector = vector<sam_value, arena_allocator<sam_value, tag_memory>>;
 
 inline sam_vector::iterator assoc(sam_vector& v, const string_slice& tag) {
 	for (auto it = v.begin(); it != v.end(); ++it) {
@@ -337,10 +410,21 @@ inline sam_vector::iterator assoc(sam_vector& v, const string_slice& tag) {
 	return v.end();
 }
 
+/* Position of one optional field in sam_alignment::raw_tags, or of a field
+	 added later (offset < 0). parsed is the field's index in
+	 sam_alignment::tags once it has been parsed, or -1. */
+class tag_entry {
+public:
+	char tag[2];
+	int32_t offset, length;
+	int32_t parsed;
+};
+
+using tag_entry_vector = vector<tag_entry, arena_allocator<tag_entry, tag_memory>>;
+
 const string_slice rg("RG");
 const string_slice ID("ID");
 const string_slice LB("LB");
-const string_slice refid("REFID");
 const string_slice libid("LIBID");
 
 const auto multiple      =   0x1;
@@ -356,6 +440,110 @@ const auto qcfailed      = 0x200;
 const auto duplicate     = 0x400;
 const auto supplementary = 0x800;
 
+/* 4-bit nucleotide codes, as in BAM. Sequences with other characters are
+	 not packed, so packing never loses information. */
+constexpr const char packed_nucleotides[] = "=ACMGRSVTWYHKDBN";
+
+constexpr auto nucleotide_codes = []() {
+	array<int8_t, 256> table{};
+	for (auto c = 0; c < 256; ++c) table[c] = -1;
+	for (auto code = 0; code < 16; ++code) table[uint8_t(packed_nucleotides[code])] = code;
+	return table;
+}();
+
+/* Dictionary of read name prefixes, such as instrument:run:flowcell. The
+	 prefixes are copied, and the ids are stable, so names from different
+	 batches can be compared by id. */
+const size_t qname_prefix_dictionary_max_size = 1 << 12;
+
+concurrent_vector<string> qname_prefixes;
+
+concurrent_unordered_map<string_view, int32_t> qname_prefix_ids;
+
+/* Returns -1 once the dictionary is full. */
+int32_t find_qname_prefix (const char* p, size_t n) {
+	string_view key(p, n);
+	auto it = qname_prefix_ids.find(key);
+	if (it != qname_prefix_ids.end()) {
+		return it->second;
+	}
+	if (qname_prefixes.size() >= qname_prefix_dictionary_max_size) {
+		return -1;
+	}
+	auto prefix = qname_prefixes.emplace_back(p, n);
+	return qname_prefix_ids.emplace(string_view(*prefix), int32_t(prefix - qname_prefixes.begin())).first->second;
+}
+
+/* Read names of the form prefix:lane:tile:x:y, as written by Illumina
+	 instruments, tokenized into a prefix id and the four numbers. Together
+	 with the digit counts, which also account for leading zeros, these
+	 determine the text, so equal names can be recognized, and names whose
+	 numbers have the same widths ordered, without looking at the text. Other
+	 names only get the hash, and comparisons fall back to the text. */
+class qname_key {
+public:
+	uint64_t hash;
+	int32_t prefix; // -1 for names in other formats
+	array<uint8_t, 4> digits;
+	array<uint32_t, 4> numbers;
+
+	qname_key () : hash(0), prefix(-1), digits{}, numbers{} {}
+
+	static inline uint64_t hash_text (const char* p, size_t n) {
+		uint64_t h = 0x9e3779b97f4a7c15ULL ^ n;
+		for (; n >= 8; p += 8, n -= 8) {
+			uint64_t word;
+			memcpy(&word, p, 8);
+			h = (h ^ word) * 0xff51afd7ed558ccdULL;
+			h ^= h >> 32;
+		}
+		if (n > 0) {
+			uint64_t word = 0;
+			memcpy(&word, p, n);
+			h = (h ^ word) * 0xff51afd7ed558ccdULL;
+		}
+		return h ^ (h >> 29);
+	}
+
+	void tokenize (const string_slice& name) {
+		auto p = name.begin();
+		int32_t end = name.size();
+		hash = hash_text(p, end);
+		prefix = -1;
+		for (auto field = 3; field >= 0; --field) {
+			uint32_t number = 0, scale = 1;
+			auto i = end - 1;
+			for (; (i >= 0) && is_digit(p[i]); --i) {
+				if (end - i > 9) return;
+				number += uint32_t(p[i] - '0') * scale;
+				scale *= 10;
+			}
+			if ((i == end - 1) || (i < 0) || (p[i] != ':')) return;
+			digits[field] = end - 1 - i;
+			numbers[field] = number;
+			end = i;
+		}
+		prefix = find_qname_prefix(p, end + 1);
+	}
+};
+
+/* Fields of an alignment, in line order, for partial parsing. */
+enum sam_field : uint32_t {
+	qname_field = 1 << 0,
+	flag_field  = 1 << 1,
+	rname_field = 1 << 2,
+	pos_field   = 1 << 3,
+	mapq_field  = 1 << 4,
+	cigar_field = 1 << 5,
+	rnext_field = 1 << 6,
+	pnext_field = 1 << 7,
+	tlen_field  = 1 << 8,
+	seq_field   = 1 << 9,
+	qual_field  = 1 << 10,
+	tags_field  = 1 << 11,
+	all_fields  = (1 << 12) - 1
+};
+
 class sam_alignment {
 public:
 	string_slice qname;
@@ -369,55 +557,153 @@ public:
 	int32_t tlen;
 	string_slice seq;
 	string_slice qual;
-	vector<sam_value> tags;
-	vector<sam_value> temps;
-
-	sam_alignment(const string_slice& line) {
-		tags.reserve(16);
+	int32_t refid;
+	int32_t next_refid;
+	// when > 0, seq holds this many nucleotides as 4-bit codes (see compact)
+	int32_t packed_seq_length;
+	/* The original line, and the fields changed since parsing (sam_field
+		 bits), so that format only re-renders what changed. Changes to flag
+		 are detected by comparing with original_flag; other changes must be
+		 recorded with mark_dirty, which the setters below do. */
+	string_slice line;
+	uint16_t original_flag;
+	uint32_t dirty;
+	/* Optional fields are kept as raw text and only indexed and parsed when
+		 a specific tag is asked for. Fields that are never parsed are written
+		 back byte for byte. */
+	string_slice raw_tags;
+	bool tags_indexed;
+	tag_entry_vector tag_index;
+	sam_vector tags;
+	sam_vector temps;
+	// keeps the arena of tag_index, tags and temps (and of this alignment) alive
+	shared_ptr<batch_arena> arena;
+
+	sam_alignment() : flag(0), pos(0), mapq(0), pnext(0), tlen(0), refid(-1), next_refid(-1), packed_seq_length(0), original_flag(0), dirty(0), tags_indexed(false) {}
+
+	sam_alignment(const string_slice& line, const reference_index& references, const shared_ptr<batch_arena>& arena = nullptr) :
+		tags_indexed(false),
+		tag_index(arena_allocator<tag_entry, tag_memory>(arena.get())),
+		tags(arena_allocator<sam_value, tag_memory>(arena.get())), temps(arena_allocator<sam_value, tag_memory>(arena.get())),
+		arena(arena) {
 		temps.reserve(4);
+		parse(line, references);
+	}
+
+	/* Parses the given fields of line. Fields that are not asked for are
+		 skipped without conversion, and the line is not scanned beyond the
+		 last field asked for. Optional fields are reset in any case. */
+	void parse (const string_slice& line, const reference_index& references, uint32_t fields = all_fields) {
+		this->line = line;
+		dirty = 0;
+		packed_seq_length = 0;
+		raw_tags = string_slice();
+		if (tags_indexed) {
+			tags_indexed = false;
+			tag_index.clear();
+			tags.clear();
+		}
+		temps.clear();
 
 		string_scanner sc(line);
 
-		qname = sc.do_string();
-		flag = sc.do_int();
-		rname = sc.do_string();
-		pos = sc.do_int();
-		mapq = sc.do_int();
-		cigar = sc.do_string();
-		rnext = sc.do_string();
-		pnext = sc.do_int();
-		tlen = sc.do_int();
-		seq = sc.do_string();
+		// fields >= f: some field at or after f is still needed
+		if (fields & qname_field) {
+			qname = sc.do_string();
+		} else sc.skip_field();
+		if (fields < flag_field) return;
+		if (fields & flag_field) original_flag = flag = sc.do_int(); else sc.skip_field();
+		if (fields < rname_field) return;
+		if (fields & (rname_field | rnext_field)) {
+			rname = sc.do_string();
+			refid = references.find(rname);
+		} else sc.skip_field();
+		if (fields < pos_field) return;
+		if (fields & pos_field) pos = sc.do_int(); else sc.skip_field();
+		if (fields < mapq_field) return;
+		if (fields & mapq_field) mapq = sc.do_int(); else sc.skip_field();
+		if (fields < cigar_field) return;
+		if (fields & cigar_field) cigar = sc.do_string(); else sc.skip_field();
+		if (fields < rnext_field) return;
+		if (fields & rnext_field) {
+			rnext = sc.do_string();
+			if ((rnext.size() == 1) && (rnext[0] == '=')) {
+				next_refid = refid;
+			} else {
+				next_refid = references.find(rnext);
+			}
+		} else sc.skip_field();
+		if (fields < pnext_field) return;
+		if (fields & pnext_field) pnext = sc.do_int(); else sc.skip_field();
+		if (fields < tlen_field) return;
+		if (fields & tlen_field) tlen = sc.do_int(); else sc.skip_field();
+		if (fields < seq_field) return;
+		if (fields & seq_field) seq = sc.do_string(); else sc.skip_field();
+		if (fields < qual_field) return;
 		qual = sc.read_until('\t');
+		if ((fields & tags_field) && (sc.length() > 0)) {
+			raw_tags = string_slice(line, sc.index);
+		}
+	}
 
-		while (sc.length() > 0) {
-			tags.push_back(parse_sam_alignment_field(sc));
+	void index_tags () {
+		tags_indexed = true;
+		int32_t size = raw_tags.size();
+		for (int32_t begin = 0; begin < size;) {
+			auto end = begin;
+			while ((end < size) && (raw_tags[end] != '\t')) ++end;
+			if ((end - begin < 3) || (raw_tags[begin+2] != ':')) {
+				throw runtime_error("Invalid field tag in SAM alignment line.");
+			}
+			tag_index.push_back(tag_entry{{raw_tags[begin], raw_tags[begin+1]}, begin, end - begin, -1});
+			begin = end + 1;
 		}
 	}
 
-	inline string_slice get_rg() {
-		return any_cast<string_slice>(assoc(tags, rg)->value);
+	inline bool has_tag (const string_slice& tag) {
+		if (!tags_indexed) index_tags();
+		for (auto& entry: tag_index) {
+			if ((entry.tag[0] == tag[0]) && (entry.tag[1] == tag[1])) return true;
+		}
+		return false;
 	}
 
-	inline void set_rg (const string_slice& value) {
-		auto it = assoc(tags, rg);
-		if (it == tags.end()) {
-			tags.push_back(sam_value(rg, value));
-		} else {
-			it->value = value;
+	/* Returns the parsed field for tag, or tags.end(). */
+	sam_vector::iterator find_tag (const string_slice& tag) {
+		if (!tags_indexed) index_tags();
+		for (auto& entry: tag_index) {
+			if ((entry.tag[0] == tag[0]) && (entry.tag[1] == tag[1])) {
+				if (entry.parsed < 0) {
+					string_scanner sc(string_slice(raw_tags, entry.offset, entry.length));
+					entry.parsed = tags.size();
+					tags.push_back(parse_sam_alignment_field(sc));
+				}
+				return tags.begin() + entry.parsed;
+			}
 		}
+		return tags.end();
+	}
+
+	inline void mark_dirty (uint32_t fields) {dirty |= fields;}
+
+	void add_tag (const sam_value& value) {
+		if (!tags_indexed) index_tags();
+		mark_dirty(tags_field);
+		tag_index.push_back(tag_entry{{value.tag[0], value.tag[1]}, -1, 0, int32_t(tags.size())});
+		tags.push_back(value);
 	}
 
-	inline int32_t get_refid () {
-		return any_cast<int32_t>(assoc(temps, refid)->value);
+	inline string_slice get_rg() {
+		return any_cast<string_slice>(find_tag(rg)->value);
 	}
 
-	inline void set_refid (int32_t value) {
-		auto it = assoc(temps, refid);
-		if (it == temps.end()) {
-			temps.push_back(sam_value(refid, value));
+	inline void set_rg (const string_slice& value) {
+		auto it = find_tag(rg);
+		if (it == tags.end()) {
+			add_tag(sam_value(rg, value));
 		} else {
 			it->value = value;
+			mark_dirty(tags_field);
 		}
 	}
 
@@ -452,38 +738,240 @@ public:
 	inline bool flag_not_every (uint16_t f) const {return (flag & f) != f;}
 	inline bool flag_not_any   (uint16_t f) const {return (flag & f) == 0;}
 
-	void format (ostream& out) const {
-		out << dec
-				<< qname << '\t'
-				<< flag << '\t'
-				<< rname << '\t'
-				<< pos << '\t'
-				<< uint32_t(mapq) << '\t'
-				<< cigar << '\t'
-				<< rnext << '\t'
-				<< pnext << '\t'
-				<< tlen << '\t'
-				<< seq << '\t'
-				<< qual;
-
-		for (auto& entry: tags) {
-			entry.format(out);
+	inline bool seq_packable () const {
+		int32_t length = seq.size();
+		if ((packed_seq_length > 0) || (length == 0) || ((length == 1) && (seq[0] == '*'))) return false;
+		for (auto p = seq.begin(), end = p + length; p != end; ++p) {
+			if (nucleotide_codes[uint8_t(*p)] < 0) return false;
+		}
+		return true;
+	}
+
+	/* Bytes that compact copies into the new storage. */
+	size_t compact_size () const {
+		size_t size = qname.size() + rname.size() + cigar.size() + rnext.size() + qual.size() + raw_tags.size();
+		size += seq_packable() ? (seq.size() + 1) / 2 : seq.size();
+		for (auto& value: tags) {
+			if (value.tag.storage == line.storage) size += value.tag.size();
+			if (auto s = any_cast<string_slice>(&value.value)) {
+				if (s->storage == line.storage) size += s->size();
+			}
+		}
+		return size;
+	}
+
+	/* Moves the text fields that still point into the input line to storage,
+		 starting at index, and packs seq as 4-bit codes when it only contains
+		 BAM nucleotide characters. Afterwards the alignment no longer refers to
+		 its input buffer, and format renders it field by field. */
+	void compact (const shared_ptr<string>& storage, size_t& index) {
+		auto old_storage = line.storage;
+		auto move_slice = [&](string_slice& slice) {
+			if (slice.is_null() || (slice.storage != old_storage)) return;
+			auto size = slice.size();
+			memcpy(&storage->operator[](index), slice.begin(), size);
+			slice = string_slice(storage, index, size);
+			index += size;
+		};
+		move_slice(qname);
+		move_slice(rname);
+		move_slice(cigar);
+		move_slice(rnext);
+		move_slice(qual);
+		move_slice(raw_tags);
+		for (auto& value: tags) {
+			move_slice(value.tag);
+			if (auto s = any_cast<string_slice>(&value.value)) move_slice(*s);
+		}
+		if (seq_packable()) {
+			int32_t length = seq.size();
+			auto out = &storage->operator[](index);
+			auto in = seq.begin();
+			for (int32_t i = 0; i + 1 < length; i += 2) {
+				*out++ = char((nucleotide_codes[uint8_t(in[i])] << 4) | nucleotide_codes[uint8_t(in[i+1])]);
+			}
+			if (length & 1) {
+				*out++ = char(nucleotide_codes[uint8_t(in[length-1])] << 4);
+			}
+			auto size = (length + 1) / 2;
+			seq = string_slice(storage, index, size);
+			index += size;
+			packed_seq_length = length;
+		} else {
+			move_slice(seq);
+		}
+		line = string_slice();
+	}
+
+	void format_seq (ostream& out) const {
+		if (packed_seq_length == 0) {
+			out << seq;
+			return;
+		}
+		char buffer[256];
+		auto in = seq.begin();
+		for (int32_t i = 0; i < packed_seq_length;) {
+			auto n = min(packed_seq_length - i, int32_t(sizeof(buffer)));
+			for (auto j = 0; j < n; ++j, ++i) {
+				auto code = uint8_t(in[i >> 1]);
+				buffer[j] = packed_nucleotides[(i & 1) ? (code & 0xf) : (code >> 4)];
+			}
+			out.write(buffer, n);
+		}
+	}
+
+	void format_tags (ostream& out) const {
+		if (!tags_indexed) {
+			if (!raw_tags.is_null()) {
+				out << '\t' << raw_tags;
+			}
+		} else {
+			for (auto& entry: tag_index) {
+				if (entry.parsed >= 0) {
+					tags[entry.parsed].format(out);
+				} else {
+					out << '\t';
+					out.write(raw_tags.begin() + entry.offset, entry.length);
+				}
+			}
 		}
+	}
+
+	void format_field (ostream& out, int field) const {
+		switch (field) {
+		case 0: out << qname; break;
+		case 1: out << flag; break;
+		case 2: out << rname; break;
+		case 3: out << pos; break;
+		case 4: out << uint32_t(mapq); break;
+		case 5: out << cigar; break;
+		case 6: out << rnext; break;
+		case 7: out << pnext; break;
+		case 8: out << tlen; break;
+		case 9: format_seq(out); break;
+		case 10: out << qual; break;
+		}
+	}
 
+	void format (ostream& out) const {
+		out << dec;
+		if (line.is_null()) {
+			for (auto field = 0; field < 11; ++field) {
+				if (field > 0) out << '\t';
+				format_field(out, field);
+			}
+			format_tags(out);
+			out << '\n';
+			return;
+		}
+		auto dirty_fields = dirty | ((flag != original_flag) ? flag_field : 0);
+		if (dirty_fields == 0) {
+			out << line << '\n';
+			return;
+		}
+		// Copy the clean spans of the original line, including their tabs,
+		// and render the dirty fields in between.
+		auto p = line.begin();
+		int32_t size = line.size();
+		array<int32_t, 12> starts; // of the mandatory fields, and of the optional fields
+		starts[0] = 0;
+		for (auto field = 1; field < 12; ++field) {
+			auto from = starts[field-1];
+			auto tab = (from < size) ? static_cast<const char*>(memchr(p + from, '\t', size - from)) : nullptr;
+			starts[field] = (tab != nullptr) ? int32_t(tab - p + 1) : size + 1;
+		}
+		int32_t clean = 0;
+		for (auto field = 0; field < 11; ++field) {
+			if (dirty_fields & (1u << field)) {
+				out.write(p + clean, starts[field] - clean);
+				format_field(out, field);
+				clean = starts[field+1] - 1;
+			}
+		}
+		if (dirty_fields & tags_field) {
+			out.write(p + clean, starts[11] - 1 - clean);
+			format_tags(out);
+		} else {
+			out.write(p + clean, size - clean);
+		}
 		out << '\n';
 	}
 };
 
+/* Allocates an alignment in arena. The alignment holds the owning reference
+	 to the arena, which the deleter only drops after the destructor has run,
+	 so the last alignment of a batch frees the arena. The control block lives
+	 on the heap, because it may outlive the arena through weak references. */
+shared_ptr<sam_alignment> make_arena_alignment (const string_slice& line, const reference_index& references, const shared_ptr<batch_arena>& arena) {
+	arena_allocator<sam_alignment, alignment_memory> alloc(arena.get());
+	auto aln = new (alloc.allocate(1)) sam_alignment(line, references, arena);
+	return shared_ptr<sam_alignment>(aln, [](sam_alignment* aln) {
+			auto arena = move(aln->arena);
+			aln->~sam_alignment();
+			arena_allocator<sam_alignment, alignment_memory>(arena.get()).deallocate(aln, 1);
+		}, counting_allocator<sam_alignment, alignment_memory>());
+}
+
 bool coordinate_less (const shared_ptr<sam_alignment>& aln1, const shared_ptr<sam_alignment>& aln2) {
-	auto refid1 = aln1->get_refid();
-	auto refid2 = aln2->get_refid();
+	auto refid1 = aln1->refid;
+	auto refid2 = aln2->refid;
 	if      (refid1 < refid2) return refid1 >= 0;
 	else if (refid2 < refid1) return refid2 < 0;
 	else                      return aln1->pos < aln2->pos;
 }
 
+/* qname keys are not stored with the alignments, where they would add 32
+	 bytes per read, but computed where they are needed. */
+inline uint64_t qname_hash (const sam_alignment& aln) {
+	return qname_key::hash_text(aln.qname.begin(), aln.qname.size());
+}
+
+/* Same order as compare on the text. */
+inline int compare_qnames (const qname_key& key1, const string_slice& qname1, const qname_key& key2, const string_slice& qname2) {
+	if ((key1.prefix >= 0) && (key1.prefix == key2.prefix)) {
+		for (auto field = 0; field < 4; ++field) {
+			if (key1.digits[field] != key2.digits[field]) break;
+			if (key1.numbers[field] != key2.numbers[field]) {
+				return (key1.numbers[field] < key2.numbers[field]) ? -1 : 1;
+			}
+			if (field == 3) return 0;
+		}
+	}
+	return compare(qname1, qname2);
+}
+
+inline int compare_qnames (const sam_alignment& aln1, const sam_alignment& aln2) {
+	qname_key key1, key2;
+	key1.tokenize(aln1.qname);
+	key2.tokenize(aln2.qname);
+	return compare_qnames(key1, aln1.qname, key2, aln2.qname);
+}
+
 bool queryname_less (const shared_ptr<sam_alignment>& aln1, const shared_ptr<sam_alignment>& aln2) {
-	return aln1->qname < aln2->qname;
+	return compare_qnames(*aln1, *aln2) < 0;
+}
+
+/* Sorts alignments by queryname. The keys only exist for the duration of
+	 the sort. */
+template<typename Container>
+void sort_by_queryname (Container& alns, bool parallel) {
+	vector<pair<qname_key, shared_ptr<sam_alignment>>> keyed(alns.size());
+	auto key = [&](size_t i){
+		keyed[i].first.tokenize(alns[i]->qname);
+		keyed[i].second = move(alns[i]);
+	};
+	auto less = [](const pair<qname_key, shared_ptr<sam_alignment>>& e1, const pair<qname_key, shared_ptr<sam_alignment>>& e2) {
+		return compare_qnames(e1.first, e1.second->qname, e2.first, e2.second->qname) < 0;
+	};
+	if (parallel) {
+		parallel_for(size_t(0), alns.size(), key);
+		parallel_sort(keyed.begin(), keyed.end(), less);
+		parallel_for(size_t(0), alns.size(), [&](size_t i){alns[i] = move(keyed[i].second);});
+	} else {
+		for (size_t i = 0; i < alns.size(); ++i) key(i);
+		sort(keyed.begin(), keyed.end(), less);
+		for (size_t i = 0; i < alns.size(); ++i) alns[i] = move(keyed[i].second);
+	}
 }
 
 class sam {
@@ -492,27 +980,16 @@ public:
 	deque<shared_ptr<sam_alignment>> alignments;
 };
 
-const unordered_map<char,char> cigar_operations({
-		{'M', 'M'},
-		{'m', 'M'},
-		{'I', 'I'},
-		{'i', 'I'},
-		{'D', 'D'},
-		{'d', 'D'},
-		{'N', 'N'},
-		{'n', 'N'},
-		{'S', 'S'},
-		{'s', 'S'},
-		{'H', 'H'},
-		{'h', 'H'},
-		{'P', 'P'},
-		{'p', 'P'},
-		{'X', 'X'},
-		{'x', 'X'},
-		{'=', '='}
-	});
-
-inline bool is_digit (char c) {return ('0' <= c) && (c <= '9');}
+// Canonical operation per CIGAR character, 0 for invalid characters.
+constexpr auto cigar_operations = []() {
+	array<char, 256> table{};
+	for (auto c: {'M', 'I', 'D', 'N', 'S', 'H', 'P', 'X'}) {
+		table[c] = c;
+		table[c - 'A' + 'a'] = c;
+	}
+	table['='] = '=';
+	return table;
+}();
 
 class cigar_operation {
 public:
@@ -522,29 +999,94 @@ public:
 };
 
 cigar_operation make_cigar_operation (const string_slice& cigar, int& i) {
-	for (auto j = i; true; ++j) {
+	int32_t length = 0;
+	for (auto j = i; j < cigar.size(); ++j) {
 		auto c = cigar[j];
-		if (!is_digit(c)) {
-			auto length = atoi(&cigar[i]);
-			auto operation = cigar_operations.at(c);
+		if (is_digit(c)) {
+			length = 10 * length + (c - '0');
+		} else {
+			auto operation = cigar_operations[uint8_t(c)];
+			if (operation == 0) {
+				throw runtime_error("Invalid CIGAR operation.");
+			}
 			i = j+1;
 			return cigar_operation(length, operation);
 		}
 	}
+	throw runtime_error("Missing CIGAR operation.");
 }
 
 const string_slice star("*");
 
-concurrent_unordered_map<string_slice, vector<cigar_operation>> cigar_cache({{star, vector<cigar_operation>()}});
+using cigar_vector = vector<cigar_operation, counting_allocator<cigar_operation, cigar_cache_memory>>;
+
+/* A parsed CIGAR string, with the summary statistics markdup needs, so that
+	 unclipped positions take constant time per read. */
+class cigar_entry {
+public:
+	string text;
+	cigar_vector operations;
+	int32_t leading_clip, trailing_clip, reference_span;
+
+	cigar_entry () : leading_clip(0), trailing_clip(0), reference_span(0) {}
+
+	static inline bool is_clip (char op) {return (op == 'S') || (op == 'H');}
+
+	static inline bool is_reference (char op) {
+		return (op == 'M') || (op == 'D') || (op == 'N') || (op == '=') || (op == 'X');
+	}
 
-const vector<cigar_operation>& scan_cigar_string(const string_slice& cigar) {
-	auto it = cigar_cache.find(cigar);
-	if (it == cigar_cache.end()) {
-		vector<cigar_operation> result; result.reserve(8);
+	void scan (const string_slice& cigar) {
+		operations.clear();
+		leading_clip = trailing_clip = reference_span = 0;
+		if (cigar == star) return;
 		for (auto i = 0; i < cigar.size();) {
-			result.push_back(make_cigar_operation(cigar, i));
+			operations.push_back(make_cigar_operation(cigar, i));
 		}
-		tie(it, ignore) = cigar_cache.emplace(cigar, result);
+		auto leading = true;
+		for (auto& op: operations) {
+			if (!is_clip(op.operation)) leading = false;
+			else if (leading) leading_clip += op.length;
+			if (is_reference(op.operation)) reference_span += op.length;
+		}
+		for (auto it = operations.rbegin(); (it != operations.rend()) && is_clip(it->operation); ++it) {
+			trailing_clip += it->length;
+		}
+	}
+};
+
+/* Dictionary of distinct CIGAR strings. Keys point into the entries' own
+	 copies of the text, so the dictionary does not pin input buffers. Once
+	 cigar_dictionary_max_size entries are reached, unseen CIGAR strings are
+	 scanned into a per-thread entry instead, which is only valid until the
+	 next call on the same thread. */
+const size_t cigar_dictionary_max_size = 1 << 16;
+
+concurrent_unordered_map<string_view, unique_ptr<cigar_entry>, hash<string_view>, equal_to<string_view>,
+												 counting_allocator<pair<const string_view, unique_ptr<cigar_entry>>, cigar_cache_memory>>
+cigar_dictionary;
+
+atomic<size_t> cigar_dictionary_size(0);
+
+const cigar_entry& scan_cigar_string(const string_slice& cigar) {
+	string_view key(cigar.begin(), cigar.size());
+	auto it = cigar_dictionary.find(key);
+	if (it != cigar_dictionary.end()) {
+		return *it->second;
+	}
+	if (cigar_dictionary_size.load(memory_order_relaxed) >= cigar_dictionary_max_size) {
+		thread_local cigar_entry uncached;
+		uncached.scan(cigar);
+		return uncached;
+	}
+	auto entry = make_unique<cigar_entry>();
+	entry->text.assign(cigar.begin(), cigar.size());
+	entry->scan(cigar);
+	string_view own_key(entry->text);
+	bool inserted;
+	tie(it, inserted) = cigar_dictionary.emplace(own_key, move(entry));
+	if (inserted) {
+		cigar_dictionary_size.fetch_add(1, memory_order_relaxed);
 	}
-	return it->second;
+	return *it->second;
 }
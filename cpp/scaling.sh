@@ -0,0 +1,133 @@
+#!/bin/bash
+# Thread-scaling and allocator comparison harness.
+#
+# Builds elprep once per allocator variant (the same flags as the
+# make-with-*.sh scripts), generates a synthetic input with gensam, and runs
+# each filter combination at each thread count via --nr-of-threads, which
+# limits the task arena. Wall time, CPU time and peak RSS come from GNU
+# time. Speedup and efficiency are relative to the smallest thread count of
+# the same variant and workload. Set TIME to use a GNU time that is not
+# installed as /usr/bin/time.
+#
+# usage: ./scaling.sh [-r reads] [-t "2 4 8 16"] [-v "glibc jemalloc tcmalloc tbbmalloc"]
+#                     [-n repetitions] [-o results.csv] [-k]
+#   -k  keep the build directory and the generated input
+#
+# At least 2 threads are needed: the input driver and the sequential output
+# stage each occupy a slot of the task arena.
+
+set -e
+
+reads=2000000
+threads=""
+variants="glibc jemalloc tcmalloc tbbmalloc"
+repetitions=1
+results=scaling-results.csv
+keep=0
+
+while getopts "r:t:v:n:o:k" opt; do
+	case $opt in
+		r) reads=$OPTARG ;;
+		t) threads=$OPTARG ;;
+		v) variants=$OPTARG ;;
+		n) repetitions=$OPTARG ;;
+		o) results=$OPTARG ;;
+		k) keep=1 ;;
+		*) exit 1 ;;
+	esac
+done
+
+if [ -z "$threads" ]; then
+	max=$(nproc)
+	threads=""
+	for ((t = 2; t < max; t *= 2)); do threads="$threads $t"; done
+	threads="$threads $max"
+fi
+for t in $threads; do
+	if [ $t -lt 2 ]; then
+		echo "Skipping thread count $t, at least 2 threads are needed." >&2
+	fi
+done
+threads=$(for t in $threads; do if [ $t -ge 2 ]; then echo -n "$t "; fi; done)
+
+TIME=${TIME:-/usr/bin/time}
+if ! $TIME -f "%e" true 2> /dev/null; then
+	echo "GNU time ($TIME) is required for CPU time and peak RSS measurements." >&2
+	exit 1
+fi
+
+cd "$(dirname "$0")"
+build=scaling-build
+mkdir -p $build
+
+workloads=(
+	"filter|--filter-unmapped-reads"
+	"read-group|--replace-read-group ID:group1\ LB:lib1\ PL:illumina\ PU:unit1\ SM:sample1"
+	"markdup|--mark-duplicates --sorting-order coordinate"
+	"best-practices|--filter-unmapped-reads --replace-read-group ID:group1\ LB:lib1\ PL:illumina\ PU:unit1\ SM:sample1 --mark-duplicates --sorting-order coordinate"
+)
+
+build_variant () {
+	case $1 in
+		glibc)     g++ -O3 -std=c++17 -pthread elprep.cpp -o $build/elprep-glibc -ltbb -lz ;;
+		jemalloc)  sh make-with-jemalloc.sh && mv elprep $build/elprep-jemalloc ;;
+		tcmalloc)  sh make-with-tcmalloc.sh && mv elprep $build/elprep-tcmalloc ;;
+		tbbmalloc) sh make-with-tbbmalloc.sh && mv elprep $build/elprep-tbbmalloc ;;
+		*) echo "Unknown variant $1." >&2; return 1 ;;
+	esac
+}
+
+built=""
+for variant in $variants; do
+	echo "Building $variant variant." >&2
+	if build_variant $variant > $build/build-$variant.log 2>&1; then
+		built="$built $variant"
+	else
+		echo "Skipping $variant variant, build failed (see $build/build-$variant.log)." >&2
+	fi
+done
+
+g++ -O3 -std=c++17 gensam.cpp -o $build/gensam
+input=$build/input-$reads.sam
+if [ ! -f $input ]; then
+	echo "Generating $reads synthetic reads." >&2
+	$build/gensam --reads $reads > $input
+fi
+
+echo "variant,workload,threads,wall,cpu,peak_rss_kb" > $results
+for variant in $built; do
+	for workload in "${workloads[@]}"; do
+		name=${workload%%|*}
+		options=${workload#*|}
+		for t in $threads; do
+			best=""
+			for ((i = 0; i < repetitions; i++)); do
+				m=$(eval "$TIME -f '%e %U %S %M' $build/elprep-$variant filter /dev/stdin /dev/stdout $options --nr-of-threads $t" \
+							< $input 2>&1 > /dev/null | tail -1)
+				if [ -z "$best" ] || awk -v a="$m" -v b="$best" 'BEGIN {split(a, x, " "); split(b, y, " "); exit !(x[1] < y[1])}'; then
+					best=$m
+				fi
+			done
+			echo "$best" | awk -v v=$variant -v w=$name -v t=$t '{printf "%s,%s,%s,%s,%.2f,%s\n", v, w, t, $1, $2 + $3, $4}' >> $results
+		done
+	done
+done
+
+# Speedup and efficiency per variant and workload, relative to the first thread count.
+awk -F, 'NR > 1 {
+	key = $1 "," $2
+	if (!(key in base_wall)) {base_wall[key] = $4; base_threads[key] = $3; order[++n] = key}
+	speedup = base_wall[key] / $4
+	efficiency = speedup / ($3 / base_threads[key])
+	line[key] = line[key] sprintf("  %7d %9.2f %9.2f %10d %8.2f %10.2f\n", $3, $4, $5, $6, speedup, efficiency)
+}
+END {
+	for (i = 1; i <= n; i++) {
+		split(order[i], k, ",")
+		printf "%s / %s\n  %7s %9s %9s %10s %8s %10s\n%s", k[1], k[2], "threads", "wall s", "cpu s", "rss KB", "speedup", "efficiency", line[order[i]]
+	}
+}' $results
+
+if [ $keep -eq 0 ]; then
+	rm -rf $build
+fi
@@ -0,0 +1,304 @@
+// elprep-bench.
+// Copyright (c) 2018-2023 imec vzw.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version, and Additional Terms
+// (see below).
+
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Affero General Public License for more details.
+
+// You should have received a copy of the GNU Affero General Public
+// License and Additional Terms along with this program. If not, see
+// <https://github.com/ExaScience/elprep-bench/blob/master/LICENSE.txt>.
+
+/* Duplicate marking spread over several processes. Each process holds its
+	 own reads, with both mates of each pair, and owns a hash range of the
+	 fragment and pair keys. While reading, a process joins mates locally
+	 and sends one compact record per read and per pair to the owner of its
+	 key, through files in a directory that all processes share. Each owner
+	 classifies the records of its range, and sends the ids of the
+	 duplicates back to the processes holding the reads.
+
+	 The verdicts are the same as those of mark_duplicates, except that ties
+	 between equal scores go to the smaller read name hash. That is
+	 independent of how the reads are distributed over the processes. */
+
+class fragment_record {
+public:
+	uint64_t library;
+	int32_t refid, pos;
+	uint8_t reversed, true_pair;
+	int32_t score;
+	uint64_t name_hash;
+	uint32_t process;
+	uint64_t read;
+};
+
+class pair_record {
+public:
+	uint64_t library;
+	int32_t refid1, pos1, refid2, pos2;
+	uint8_t reversed1, reversed2;
+	int32_t score;
+	uint64_t name_hash;
+	uint32_t process;
+	uint64_t read1, read2;
+};
+
+inline uint64_t mix_key (uint64_t h, uint64_t v) {
+	h = (h ^ v) * 0xff51afd7ed558ccdULL;
+	return h ^ (h >> 32);
+}
+
+inline uint64_t fragment_key_hash (const fragment_record& r) {
+	return mix_key(mix_key(mix_key(r.library, uint32_t(r.refid)), uint32_t(r.pos)), r.reversed);
+}
+
+inline uint64_t pair_key_hash (const pair_record& r) {
+	auto h = mix_key(mix_key(mix_key(r.library, uint32_t(r.refid1)), uint32_t(r.pos1)), r.reversed1);
+	return mix_key(mix_key(mix_key(h, uint32_t(r.refid2)), uint32_t(r.pos2)), r.reversed2);
+}
+
+inline auto fragment_key (const fragment_record& r) {
+	return make_tuple(r.library, r.refid, r.pos, r.reversed);
+}
+
+inline auto pair_key (const pair_record& r) {
+	return make_tuple(r.library, r.refid1, r.pos1, r.reversed1, r.refid2, r.pos2, r.reversed2);
+}
+
+/* Better records come first: higher score, then smaller name hash, then
+	 smaller read id. */
+inline bool better (const fragment_record& r1, const fragment_record& r2) {
+	if (r1.score != r2.score) return r1.score > r2.score;
+	if (r1.name_hash != r2.name_hash) return r1.name_hash < r2.name_hash;
+	return make_pair(r1.process, r1.read) < make_pair(r2.process, r2.read);
+}
+
+inline bool better (const pair_record& r1, const pair_record& r2) {
+	if (r1.score != r2.score) return r1.score > r2.score;
+	if (r1.name_hash != r2.name_hash) return r1.name_hash < r2.name_hash;
+	return make_pair(r1.process, r1.read1) < make_pair(r2.process, r2.read1);
+}
+
+const string_slice read_id("read id");
+
+inline uint64_t get_read_id (const shared_ptr<sam_alignment>& aln) {
+	return any_cast<uint64_t>(assoc(aln->temps, read_id)->value);
+}
+
+inline void set_read_id (const shared_ptr<sam_alignment>& aln, uint64_t value) {
+	aln->temps.push_back(sam_value(read_id, value));
+}
+
+template<typename T> void write_records (const string& name, const T* records, size_t n) {
+	// rename is atomic, so readers never see partial files
+	auto tmp = name + ".tmp";
+	ofstream out(tmp, ios::binary);
+	out.write(reinterpret_cast<const char*>(records), n * sizeof(T));
+	out.close();
+	if (out.fail() || (rename(tmp.c_str(), name.c_str()) != 0)) {
+		throw runtime_error("Cannot write " + name + ".");
+	}
+}
+
+const auto sharded_exchange_timeout = chrono::hours(12);
+
+/* Waits for a file from another process. Gives up when that process has
+	 left its abort marker, or after sharded_exchange_timeout, which catches
+	 processes that were killed before they could leave one. */
+template<typename T> vector<T> read_records (const string& name, const string& abort_name) {
+	auto start = chrono::steady_clock::now();
+	auto reported = false;
+	for (auto wait = chrono::milliseconds(1); access(name.c_str(), F_OK) != 0; wait = min(2 * wait, chrono::milliseconds(100))) {
+		if (access(abort_name.c_str(), F_OK) == 0) {
+			throw runtime_error("Duplicate marking exchange aborted, found " + abort_name + ".");
+		}
+		auto waited = chrono::steady_clock::now() - start;
+		if (waited > sharded_exchange_timeout) {
+			throw runtime_error("Timed out waiting for " + name + ".");
+		}
+		if (!reported && (waited > chrono::minutes(1))) {
+			cerr << "Waiting for " << name << ".\n";
+			reported = true;
+		}
+		this_thread::sleep_for(wait);
+	}
+	ifstream in(name, ios::binary | ios::ate);
+	auto size = size_t(in.tellg());
+	in.seekg(0);
+	vector<T> records(size / sizeof(T));
+	in.read(reinterpret_cast<char*>(records.data()), records.size() * sizeof(T));
+	if (in.fail()) {
+		throw runtime_error("Cannot read " + name + ".");
+	}
+	in.close();
+	unlink(name.c_str());
+	return records;
+}
+
+class mark_duplicates_shard {
+public:
+	string path;
+	uint32_t process, nof_processes;
+	concurrent_vector<shared_ptr<sam_alignment>> reads;
+	vector<concurrent_vector<fragment_record>> fragments;
+	vector<concurrent_vector<pair_record>> pairs;
+
+	mark_duplicates_shard (const string& path, uint32_t process, uint32_t nof_processes) :
+		path(path), process(process), nof_processes(nof_processes), fragments(nof_processes), pairs(nof_processes) {
+		if ((nof_processes == 0) || (process >= nof_processes)) {
+			throw runtime_error("Invalid duplicate marking shard.");
+		}
+		/* Left by an earlier, failed run. The other processes would take its
+			 records for this run's, so they must go before this process reads
+			 any input, and the peers must not finish reading theirs before
+			 this process starts. */
+		unlink(abort_name(process).c_str());
+		for (uint32_t to = 0; to < nof_processes; ++to) {
+			for (auto kind: {"fragments", "pairs", "verdicts"}) {
+				auto name = file_name(kind, process, to);
+				unlink(name.c_str());
+				unlink((name + ".tmp").c_str());
+			}
+		}
+	}
+
+	string file_name (const char* kind, uint32_t from, uint32_t to) const {
+		return path + "/" + kind + "-" + to_string(from) + "-" + to_string(to) + ".bin";
+	}
+
+	string abort_name (uint32_t from) const {
+		return path + "/abort-" + to_string(from);
+	}
+
+	/* Tells the other processes that this one will not deliver its records,
+		 so that they fail instead of waiting for them. */
+	void abort () const {
+		ofstream marker(abort_name(process));
+	}
+
+	/* Runs after all reads have been added: exchanges the records, classifies
+		 the ones in this process's range, and marks the duplicates among this
+		 process's reads. */
+	void exchange ();
+};
+
+void mark_duplicates_shard::exchange () {
+	for (uint32_t to = 0; to < nof_processes; ++to) {
+		vector<fragment_record> f(fragments[to].begin(), fragments[to].end());
+		write_records(file_name("fragments", process, to), f.data(), f.size());
+		vector<pair_record> p(pairs[to].begin(), pairs[to].end());
+		write_records(file_name("pairs", process, to), p.data(), p.size());
+		fragments[to].clear();
+		pairs[to].clear();
+	}
+	vector<fragment_record> my_fragments;
+	vector<pair_record> my_pairs;
+	for (uint32_t from = 0; from < nof_processes; ++from) {
+		auto f = read_records<fragment_record>(file_name("fragments", from, process), abort_name(from));
+		my_fragments.insert(my_fragments.end(), f.begin(), f.end());
+		auto p = read_records<pair_record>(file_name("pairs", from, process), abort_name(from));
+		my_pairs.insert(my_pairs.end(), p.begin(), p.end());
+	}
+	vector<vector<uint64_t>> verdicts(nof_processes);
+	// A true fragment is a duplicate if a true pair has the same key, or
+	// otherwise if it is not the best true fragment with that key.
+	parallel_sort(my_fragments.begin(), my_fragments.end(), [](const fragment_record& r1, const fragment_record& r2){
+			auto k1 = fragment_key(r1), k2 = fragment_key(r2);
+			if (k1 != k2) return k1 < k2;
+			if (r1.true_pair != r2.true_pair) return r1.true_pair > r2.true_pair;
+			return better(r1, r2);
+		});
+	for (size_t begin = 0, end; begin < my_fragments.size(); begin = end) {
+		auto key = fragment_key(my_fragments[begin]);
+		for (end = begin + 1; (end < my_fragments.size()) && (fragment_key(my_fragments[end]) == key); ++end);
+		// true pairs first, then the best true fragment
+		auto first_duplicate = my_fragments[begin].true_pair ? begin : begin + 1;
+		for (auto i = first_duplicate; i < end; ++i) {
+			auto& r = my_fragments[i];
+			if (!r.true_pair) verdicts[r.process].push_back(r.read);
+		}
+	}
+	// A pair is a duplicate if it is not the best pair with that key.
+	parallel_sort(my_pairs.begin(), my_pairs.end(), [](const pair_record& r1, const pair_record& r2){
+			auto k1 = pair_key(r1), k2 = pair_key(r2);
+			if (k1 != k2) return k1 < k2;
+			return better(r1, r2);
+		});
+	for (size_t begin = 0, end; begin < my_pairs.size(); begin = end) {
+		auto key = pair_key(my_pairs[begin]);
+		for (end = begin + 1; (end < my_pairs.size()) && (pair_key(my_pairs[end]) == key); ++end) {
+			auto& r = my_pairs[end];
+			verdicts[r.process].push_back(r.read1);
+			verdicts[r.process].push_back(r.read2);
+		}
+	}
+	for (uint32_t to = 0; to < nof_processes; ++to) {
+		write_records(file_name("verdicts", process, to), verdicts[to].data(), verdicts[to].size());
+	}
+	for (uint32_t from = 0; from < nof_processes; ++from) {
+		for (auto read: read_records<uint64_t>(file_name("verdicts", from, process), abort_name(from))) {
+			reads[read]->flag |= duplicate;
+		}
+	}
+	reads.clear();
+}
+
+/* Like mark_duplicates, but only prepares the records; shard->exchange()
+	 marks the duplicates once all reads have been seen. */
+header_filter mark_duplicates_sharded (const shared_ptr<mark_duplicates_shard>& shard) {
+	return [shard](const shared_ptr<sam_header>& header) -> alignment_filter {
+		auto pair_fragments = make_shared<pair_fragment_map>(1000000);
+		string_map lb_table;
+		for (auto& rg_entry: header->rg) {
+			auto lb_it = rg_entry.find(LB);
+			if (lb_it != rg_entry.end()) {
+				auto id_it = rg_entry.find(ID);
+				if (id_it == rg_entry.end()) {
+					throw runtime_error("Missing mandatory ID entry in an @RG line in a SAM file header.");
+				}
+				lb_table.emplace(id_it->second, lb_it->second);
+			}
+		}
+		return [lb_table, pair_fragments, shard](const shared_ptr<sam_alignment>& aln) -> bool {
+			if (!aln->flag_not_any(unmapped | secondary | duplicate | supplementary)) return true;
+			adapt_alignment(aln, lb_table);
+			uint64_t id = shard->reads.push_back(aln) - shard->reads.begin();
+			set_read_id(aln, id);
+			auto libid = aln->get_libid();
+			auto library = qname_key::hash_text(libid.begin(), libid.size());
+			fragment_record f{library, aln->refid, get_adapted_pos(aln), aln->is_reversed(), is_true_pair(aln),
+												get_adapted_score(aln), qname_hash(*aln), shard->process, id};
+			shard->fragments[fragment_key_hash(f) % shard->nof_processes].push_back(f);
+			if (!is_true_pair(aln)) return true;
+			auto aln2 = [&]() -> shared_ptr<sam_alignment> {
+				pair_fragment_map::accessor acc;
+				if (pair_fragments->insert(acc, aln)) {
+					acc->second = aln;
+					return nullptr;
+				} else {
+					auto aln2 = acc->second;
+					pair_fragments->erase(acc);
+					return aln2;
+				}
+			}();
+			if (aln2 == nullptr) return true;
+			auto aln1 = aln;
+			if (make_tuple(get_adapted_pos(aln1), aln1->refid, aln1->is_reversed()) >
+					make_tuple(get_adapted_pos(aln2), aln2->refid, aln2->is_reversed())) {
+				swap(aln1, aln2);
+			}
+			pair_record p{library, aln1->refid, get_adapted_pos(aln1), aln2->refid, get_adapted_pos(aln2),
+										aln1->is_reversed(), aln2->is_reversed(), get_adapted_score(aln1) + get_adapted_score(aln2),
+										qname_hash(*aln), shard->process, get_read_id(aln1), get_read_id(aln2)};
+			shard->pairs[pair_key_hash(p) % shard->nof_processes].push_back(p);
+			return true;
+		};
+	};
+}
@@ -16,7 +16,7 @@
 // License and Additional Terms along with this program. If not, see
 // <https://github.com/ExaScience/elprep-bench/blob/master/LICENSE.txt>.
 
-const string_slice SN("SN");
+const sam_field_access replace_reference_sequence_dictionary_access(rname_field);
 
 header_filter replace_reference_sequence_dictionary (const vector<string_map>& dict) {
 	return [dict](const shared_ptr<sam_header>& header) -> alignment_filter {
@@ -31,7 +31,7 @@ header_filter replace_reference_sequence_dictionary (const vector<string_map>& d
 				auto sn = it->second;
 				auto pos = find(old_dict, [&sn](const string_map& entry){
 						auto it = entry.find(SN);
-						return (it != entry.end()) && (it->second == SN);
+						return (it != entry.end()) && (it->second == sn);
 					});
 				if (pos >= 0) {
 					if (pos > previous_pos) {
@@ -43,17 +43,10 @@ header_filter replace_reference_sequence_dictionary (const vector<string_map>& d
 				}
 			}
 		}
-		auto dict_table = make_shared<multiset<string_slice>>();
-		for (auto& entry: dict) {
-			auto it = entry.find(SN);
-			if (it == entry.end()) {
-				throw runtime_error("SN not found.");
-			}
-			dict_table->insert(it->second);
-		}
 		header->sq = dict;
-		return [dict_table](const shared_ptr<sam_alignment>& aln) -> bool {
-			return dict_table->count(aln->rname) > 0;
+		// The parser resolves refids against the new dictionary.
+		return [](const shared_ptr<sam_alignment>& aln) -> bool {
+			return aln->refid >= 0;
 		};
 	};
 }
@@ -65,27 +58,84 @@ header_filter replace_reference_sequence_dictionary_from_sam_file (const string&
 	return replace_reference_sequence_dictionary(header.sq);
 }
 
+const sam_field_access filter_unmapped_reads_access(flag_field);
+
 alignment_filter filter_unmapped_reads (const shared_ptr<sam_header>&) {
 	return [](const shared_ptr<sam_alignment>& aln){
 		return (aln->flag & unmapped) == 0;
 	};
 }
 
+const sam_field_access filter_unmapped_reads_strict_access(flag_field | rname_field | pos_field);
+
 alignment_filter filter_unmapped_reads_strict (const shared_ptr<sam_header>&) {
 	return [](const shared_ptr<sam_alignment>& aln){
 		return ((aln->flag & unmapped) == 0) && (aln->pos != 0) && (aln->rname != star);
 	};
 }
 
+const sam_field_access filter_duplicate_reads_access(flag_field);
+
 alignment_filter filter_duplicate_reads (const shared_ptr<sam_header>&) {
 	return [](const shared_ptr<sam_alignment>& aln){
 		return (aln->flag & duplicate) == 0;
 	};
 }
 
+const sam_field_access bin_quality_scores_access(qual_field, qual_field);
+
+alignment_filter bin_quality_scores (const shared_ptr<sam_header>&) {
+	return [](const shared_ptr<sam_alignment>& aln){
+		auto& qual = aln->qual;
+		if (qual != star) {
+			bin_quality_string(qual.begin(), qual.size());
+		}
+		return true;
+	};
+}
+
+const sam_field_access filter_regions_access(flag_field | rname_field | pos_field | cigar_field);
+
+/* Keeps the reads that overlap one of the regions. The index chunks that a
+	 region query reads also contain reads near the regions. */
+header_filter filter_regions (const shared_ptr<region_query>& query) {
+	return [query](const shared_ptr<sam_header>& header) -> alignment_filter {
+		// disjoint intervals per contig, sorted by begin and so also by end
+		auto intervals = make_shared<unordered_map<string_slice, vector<pair<int64_t, int64_t>>>>();
+		for (auto& region: query->resolve(*header)) {
+			(*intervals)[string_slice(region.contig)].emplace_back(region.beg, region.end);
+		}
+		for (auto& [contig, list]: *intervals) {
+			sort(list.begin(), list.end());
+			vector<pair<int64_t, int64_t>> merged;
+			for (auto& interval: list) {
+				if (!merged.empty() && (interval.first <= merged.back().second)) {
+					merged.back().second = max(merged.back().second, interval.second);
+				} else {
+					merged.push_back(interval);
+				}
+			}
+			list.swap(merged);
+		}
+		return [intervals](const shared_ptr<sam_alignment>& aln) -> bool {
+			auto it = intervals->find(aln->rname);
+			if (it == intervals->end()) return false;
+			index_entry entry(*aln, 0);
+			auto& list = it->second;
+			// the last interval that begins before the read ends
+			auto next = upper_bound(list.begin(), list.end(), entry.end - 1, [](int64_t pos, const pair<int64_t, int64_t>& interval){
+					return pos < interval.first;
+				});
+			return (next != list.begin()) && (prev(next)->second > entry.beg);
+		};
+	};
+}
+
 const string_slice sr("sr");
 const string_slice at_sr("@sr");
 
+const sam_field_access filter_optional_reads_access(tags_field);
+
 alignment_filter filter_optional_reads (const shared_ptr<sam_header>& header) {
 	auto record = header->user_records.find(at_sr);
 	if (record == header->user_records.end()) {
@@ -93,11 +143,13 @@ alignment_filter filter_optional_reads (const shared_ptr<sam_header>& header) {
 	} else {
 		header->user_records.erase(record);
 		return [](const shared_ptr<sam_alignment>& aln){
-			return assoc(aln->tags, sr) == aln->tags.end();
+			return !aln->has_tag(sr);
 		};
 	}
 }
 
+const sam_field_access add_or_replace_read_group_access(tags_field, tags_field);
+
 header_filter add_or_replace_read_group (const string_map& read_group) {
 	return [read_group](const shared_ptr<sam_header>& header) -> alignment_filter {
 		header->rg = {read_group};
@@ -156,20 +208,3 @@ header_filter add_pg_line (string_map& new_pg) {
 		return nullptr;
 	};
 }
-
-alignment_filter add_refid (const shared_ptr<sam_header>& header) {
-	auto dict_table = make_shared<unordered_map<string_slice, int32_t>>();
-	for (int32_t index = 0; index < header->sq.size(); index++) {
-		auto& sq = header->sq[index];
-		auto it = sq.find(SN);
-		if (it == sq.end()) {
-			throw runtime_error("SN not found.");
-		}
-		dict_table->insert({it->second, index});
-	}
-	return [dict_table](const shared_ptr<sam_alignment>& aln) -> bool {
-		auto it = dict_table->find(aln->rname);
-		aln->set_refid((it == dict_table->end()) ? -1 : it->second);
-		return true;
-	};
-}
@@ -79,6 +79,7 @@ public:
 			result->push_back(line);
 		}
 		d = (fetched == 0) ? nullptr : result;
+		count_reads(fetched);
 		return fetched;
 	}
 
@@ -0,0 +1,245 @@
+// elprep-bench.
+// Copyright (c) 2018-2023 imec vzw.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version, and Additional Terms
+// (see below).
+
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Affero General Public License for more details.
+
+// You should have received a copy of the GNU Affero General Public
+// License and Additional Terms along with this program. If not, see
+// <https://github.com/ExaScience/elprep-bench/blob/master/LICENSE.txt>.
+
+/* elprep split partitions a SAM file by contig, so that the partitions can
+	 be processed independently, and combined again with elprep merge.
+
+	 Reads go to the partition of their contig, and reads without a contig
+	 to the unmapped partition. Pairs whose mates map to different contigs
+	 go to the spread partition with both mates, so that markdup on the spread
+	 partition sees complete pairs. Each such read is also copied to its
+	 contig's partition, tagged with sr:i:1, so that markdup on that partition
+	 still sees the pair's position when it classifies single reads. The
+	 contig partitions get an @sr header record, so that filter removes the
+	 tagged copies after duplicate marking (see filter_optional_reads). */
+
+const string spread_read_tag("sr:i:1");
+
+class split_partitions {
+public:
+	vector<string> names;
+	vector<int32_t> contig_partitions; // partition per reference id
+	int32_t unmapped, spread;
+
+	/* Consecutive contigs share a partition until their lengths add up to at
+		 least group_size. A group_size of 0 gives each contig its own. */
+	split_partitions (const vector<string_map>& sq, int64_t group_size) {
+		int64_t group_length = 0;
+		for (auto& record: sq) {
+			if (names.empty() || (group_length >= group_size)) {
+				auto name = record.at(SN);
+				names.emplace_back(name.begin(), name.size());
+				group_length = 0;
+			}
+			contig_partitions.push_back(names.size() - 1);
+			group_length += get_sq_ln(record);
+		}
+		unmapped = names.size();
+		names.emplace_back("unmapped");
+		spread = names.size();
+		names.emplace_back("spread");
+	}
+};
+
+/* One output buffer per partition for each batch. */
+using split_batch = vector<string>;
+
+/* Writes the partitions assigned to it on a thread of its own, in the
+	 order their buffers are pushed. At most max_open of its files are open at
+	 a time; the least recently written one is closed when another is needed,
+	 and reopened for appending later. A failure is kept for finish() to
+	 report, and later buffers are then dropped, so that push never blocks
+	 for good. */
+class split_writer {
+public:
+	split_writer (const vector<string>& file_names, size_t max_open) :
+		file_names(file_names), max_open(max(max_open, size_t(1))) {
+		buffers.set_capacity(64);
+		worker = thread([this](){write_buffers();});
+	}
+
+	void push (const shared_ptr<split_batch>& batch, int32_t partition) {
+		buffers.push({batch, partition});
+	}
+
+	/* Waits for all pushed buffers, and closes the files. */
+	void finish () {
+		buffers.push({nullptr, -1});
+		worker.join();
+		if (error) rethrow_exception(error);
+	}
+
+private:
+	const vector<string>& file_names;
+	size_t max_open;
+	concurrent_bounded_queue<pair<shared_ptr<split_batch>, int32_t>> buffers;
+	list<pair<int32_t, unique_ptr<ofstream>>> open_files; // most recently written first
+	unordered_map<int32_t, decltype(open_files)::iterator> open_index;
+	exception_ptr error;
+	thread worker;
+
+	void close (pair<int32_t, unique_ptr<ofstream>>& file) {
+		file.second->close();
+		if (file.second->fail()) {
+			throw runtime_error("Error writing " + file_names[file.first] + ".");
+		}
+	}
+
+	ofstream& output (int32_t partition) {
+		auto it = open_index.find(partition);
+		if (it != open_index.end()) {
+			open_files.splice(open_files.begin(), open_files, it->second);
+			return *open_files.front().second;
+		}
+		if (open_files.size() >= max_open) {
+			close(open_files.back());
+			open_index.erase(open_files.back().first);
+			open_files.pop_back();
+		}
+		auto& file_name = file_names[partition];
+		open_files.emplace_front(partition, make_unique<ofstream>(file_name, ios::app));
+		if (!*open_files.front().second) {
+			throw runtime_error("Cannot open " + file_name + ".");
+		}
+		open_index[partition] = open_files.begin();
+		return *open_files.front().second;
+	}
+
+	void write_buffers () {
+		while (true) {
+			pair<shared_ptr<split_batch>, int32_t> next;
+			buffers.pop(next);
+			if (next.first == nullptr) break;
+			if (error) continue;
+			try {
+				auto& buffer = (*next.first)[next.second];
+				output(next.second).write(buffer.data(), buffer.size());
+			} catch (...) {
+				error = current_exception();
+			}
+		}
+		try {
+			for (auto& file: open_files) close(file);
+		} catch (...) {
+			if (!error) error = current_exception();
+		}
+	}
+};
+
+// for all partitions together, however many contigs there are
+const size_t split_writer_threads = 4;
+const size_t split_open_files = 256;
+
+filter split_lines (const shared_ptr<reference_index>& references, const shared_ptr<split_partitions>& partitions) {
+	return receive([references, partitions](int seq_no, any data) -> any {
+			try {
+				auto lines = any_cast<shared_ptr<deque<string_slice>>>(data);
+				auto result = make_shared<split_batch>(partitions->names.size());
+				sam_alignment aln;
+				for (auto& line: *lines) {
+					aln.parse(line, *references, flag_field | rname_field | rnext_field);
+					if (aln.refid < 0) {
+						auto& out = (*result)[partitions->unmapped];
+						out.append(line.begin(), line.size());
+						out.push_back('\n');
+						continue;
+					}
+					auto& out = (*result)[partitions->contig_partitions[aln.refid]];
+					out.append(line.begin(), line.size());
+					if (aln.is_multiple() && (aln.next_refid >= 0) && (aln.next_refid != aln.refid)) {
+						out.push_back('\t');
+						out.append(spread_read_tag);
+						auto& spread = (*result)[partitions->spread];
+						spread.append(line.begin(), line.size());
+						spread.push_back('\n');
+					}
+					out.push_back('\n');
+				}
+				return result;
+			} catch (bad_any_cast& ex) {
+				throw runtime_error("unexpected type in split_lines");
+			}
+		});
+}
+
+void split_sam_file (istream& input, const string& output_path, const string& output_prefix, int64_t contig_group_size) {
+	istream_wrapper in(input);
+	auto header = make_shared<sam_header>(in);
+	auto references = make_shared<reference_index>(header->sq);
+	auto partitions = make_shared<split_partitions>(header->sq, contig_group_size);
+	if ((mkdir(output_path.c_str(), 0777) != 0) && (errno != EEXIST)) {
+		throw runtime_error("Cannot create directory " + output_path + ".");
+	}
+	auto contig_header = make_shared<sam_header>(*header);
+	contig_header->add_user_record(at_sr, string_map{{string_slice("co"), string_slice("This file was created using elprep split.")}});
+	vector<string> file_names;
+	for (auto& name: partitions->names) {
+		auto file_name = output_path + "/" + output_prefix + "-" + name + ".sam";
+		replace(file_name.begin() + output_path.size() + 1, file_name.end(), '/', '_');
+		ofstream out(file_name);
+		if (!out) {
+			throw runtime_error("Cannot open " + file_name + ".");
+		}
+		int32_t partition = file_names.size();
+		((partition < partitions->unmapped) ? contig_header : header)->format(out);
+		out.close();
+		if (out.fail()) {
+			throw runtime_error("Error writing " + file_name + ".");
+		}
+		file_names.push_back(file_name);
+	}
+	// Partition i always goes to writer i % writers.size(), so each partition
+	// is written in input order, and different partitions in parallel.
+	// Writers are threads rather than tasks, because waiting for tasks from
+	// inside a pipeline node can deadlock.
+	vector<unique_ptr<split_writer>> writers;
+	auto nof_writers = min(split_writer_threads, file_names.size());
+	for (size_t i = 0; i < nof_writers; ++i) {
+		writers.push_back(make_unique<split_writer>(file_names, split_open_files / nof_writers));
+	}
+	pipeline p;
+	p.src = make_shared<istream_source>(in);
+	p.nodes.emplace_back(make_shared<parnode>(vector<filter>{split_lines(references, partitions)}));
+	p.nodes.emplace_back(make_shared<seqnode>(ordered, vector<filter>{
+				receive([&writers](int seq_no, any data) -> any {
+						try {
+							auto buffers = any_cast<shared_ptr<split_batch>>(data);
+							for (size_t i = 0; i < buffers->size(); ++i) {
+								if (!(*buffers)[i].empty()) writers[i % writers.size()]->push(buffers, i);
+							}
+							return data;
+						} catch (bad_any_cast& ex) {
+							throw runtime_error("unexpected type in split_sam_file");
+						}
+					})
+					}));
+	exception_ptr error;
+	try {
+		run(p);
+	} catch (...) {
+		error = current_exception();
+	}
+	for (auto& writer: writers) {
+		try {
+			writer->finish();
+		} catch (...) {
+			if (!error) error = current_exception();
+		}
+	}
+	if (error) rethrow_exception(error);
+}
@@ -25,6 +25,40 @@ inline void set_unique_entry(string_map& record, const pair<string_slice, string
 	}
 }
 
+inline bool is_digit (char c) {return ('0' <= c) && (c <= '9');}
+
+/* Parses a decimal integer like atoi: an optional sign, then digits up to
+	 the first non-digit. Fields of up to 8 digits are converted with SWAR
+	 arithmetic on a single 64-bit load, when the underlying buffer has 8
+	 readable bytes from the first digit on. */
+inline int64_t parse_integer (const string_slice& field) {
+	auto p = field.begin();
+	int64_t n = field.size();
+	auto negative = false;
+	if ((n > 0) && ((*p == '-') || (*p == '+'))) {
+		negative = *p == '-';
+		++p; --n;
+	}
+	if ((n > 0) && (n <= 8) && (int64_t(field.storage->size()) - (p - field.storage->data()) >= 8)) {
+		uint64_t chunk;
+		memcpy(&chunk, p, 8);
+		// little endian: the first digit ends up in the lowest byte, and the
+		// shift turns the bytes after the field into leading zeros
+		auto digits = (chunk - 0x3030303030303030ULL) << (8 * (8 - n));
+		if ((((digits + 0x7676767676767676ULL) | digits) & 0x8080808080808080ULL) == 0) {
+			digits = (digits * 2561) >> 8;
+			digits = ((digits & 0x00FF00FF00FF00FFULL) * 6553601) >> 16;
+			digits = ((digits & 0x0000FFFF0000FFFFULL) * 42949672960001ULL) >> 32;
+			return negative ? -int64_t(digits) : int64_t(digits);
+		}
+	}
+	int64_t result = 0;
+	for (; (n > 0) && is_digit(*p); ++p, --n) {
+		result = 10 * result + (*p - '0');
+	}
+	return negative ? -result : result;
+}
+
 class string_scanner {
 public:
 	const string_slice str;
@@ -95,8 +129,19 @@ public:
 		return slice;
 	}
 
+	inline void skip_field() {
+		auto len = str.size();
+		for (auto end = index; end < len; ++end) {
+			if (str[end] == '\t') {
+				index = end+1;
+				return;
+			}
+		}
+		throw runtime_error("Missing tabulator in SAM alignment line.");
+	}
+
 	inline int32_t do_int() {
-		return atoi(do_string().begin());
+		return parse_integer(do_string());
 	}
 
 	pair<string_slice, string_slice> parse_sam_header_field() {
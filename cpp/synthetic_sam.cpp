@@ -0,0 +1,212 @@
+// elprep-bench.
+// Copyright (c) 2018-2023 imec vzw.
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version, and Additional Terms
+// (see below).
+
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Affero General Public License for more details.
+
+// You should have received a copy of the GNU Affero General Public
+// License and Additional Terms along with this program. If not, see
+// <https://github.com/ExaScience/elprep-bench/blob/master/LICENSE.txt>.
+
+/* Deterministic generator for synthetic SAM files. The output only depends
+	 on the options, including the seed, so benchmark inputs can be recreated
+	 anywhere instead of being downloaded. Random numbers are drawn directly
+	 from mt19937_64, whose output sequence is fixed by the standard, so the
+	 output is also the same across standard library implementations. */
+
+class synthetic_sam_options {
+public:
+	int64_t nof_reads = 1000000;
+	int32_t read_length = 150;
+	double duplicate_rate = 0.1;
+	double paired_rate = 1.0;
+	double unmapped_rate = 0.02;
+	int32_t nof_tags = 4;
+	int32_t nof_contigs = 25;
+	int32_t contig_length = 10000000;
+	uint64_t seed = 42;
+};
+
+/* Parses one generator option from args, if entry is one. Returns false
+	 for entries that are not generator options. */
+bool parse_synthetic_sam_option (const string& entry, list<string>& args, synthetic_sam_options& options) {
+	auto value = [&]() -> string {
+		if (args.empty()) {
+			throw runtime_error("Missing value for " + entry + ".");
+		}
+		auto v = args.front(); args.pop_front();
+		return v;
+	};
+	if (entry == "--reads") options.nof_reads = stoll(value());
+	else if (entry == "--read-length") options.read_length = stoi(value());
+	else if (entry == "--duplicate-rate") options.duplicate_rate = stod(value());
+	else if (entry == "--paired-rate") options.paired_rate = stod(value());
+	else if (entry == "--unmapped-rate") options.unmapped_rate = stod(value());
+	else if (entry == "--tags") options.nof_tags = stoi(value());
+	else if (entry == "--contigs") options.nof_contigs = stoi(value());
+	else if (entry == "--contig-length") options.contig_length = stoi(value());
+	else if (entry == "--seed") options.seed = stoull(value());
+	else return false;
+	if ((options.read_length < 10) || (options.nof_contigs < 1) || (options.contig_length <= 2 * options.read_length)) {
+		throw runtime_error("Invalid synthetic SAM options.");
+	}
+	return true;
+}
+
+const char* const synthetic_sam_option_help =
+	"  --reads n            number of reads (default 1000000)\n"
+	"  --read-length n      read length (default 150)\n"
+	"  --duplicate-rate f   fraction of fragments that duplicate an earlier one (default 0.1)\n"
+	"  --paired-rate f      fraction of fragments that are pairs (default 1.0)\n"
+	"  --unmapped-rate f    fraction of unmapped fragments (default 0.02)\n"
+	"  --tags n             optional fields per read besides RG (default 4)\n"
+	"  --contigs n          number of @SQ contigs (default 25)\n"
+	"  --contig-length n    length of each contig (default 10000000)\n"
+	"  --seed n             random seed (default 42)\n";
+
+class synthetic_sam_generator {
+public:
+	synthetic_sam_options options;
+	mt19937_64 rng;
+
+	class fragment {
+	public:
+		int32_t contig, pos, mate_pos;
+		bool reversed;
+	};
+
+	vector<fragment> originals;
+
+	synthetic_sam_generator (const synthetic_sam_options& options) :
+		options(options), rng(options.seed) {}
+
+	inline uint64_t uniform (uint64_t n) {return rng() % n;}
+
+	inline bool chance (double p) {return double(rng() >> 11) * (1.0 / 9007199254740992.0) < p;}
+
+	void format_header (ostream& out) {
+		out << "@HD\tVN:1.5\tSO:unsorted\n";
+		for (auto c = 0; c < options.nof_contigs; ++c) {
+			out << "@SQ\tSN:chr" << (c + 1) << "\tLN:" << options.contig_length << '\n';
+		}
+		out << "@RG\tID:rg1\tLB:lib1\tPL:illumina\tSM:sample1\n";
+		out << "@PG\tID:synthetic\tPN:gensam\n";
+	}
+
+	void format_name (ostream& out, int64_t n) {
+		// Illumina-style read names: instrument:run:flowcell:lane:tile:x:y
+		out << "SYN:1:FC0001:" << (1 + n % 8) << ':' << (1101 + (n / 8) % 64) << ':' << (1000 + (n / 512) % 30000) << ':' << (1000 + n % 99991);
+	}
+
+	string cigar_for (int32_t length) {
+		switch (uniform(8)) {
+		case 0: return to_string(5) + "S" + to_string(length - 5) + "M";
+		case 1: return to_string(length - 7) + "M" + to_string(7) + "S";
+		case 2: {
+			auto left = length / 2;
+			return to_string(left) + "M2I" + to_string(length - left - 2) + "M";
+		}
+		case 3: {
+			auto left = length / 3;
+			return to_string(left) + "M3D" + to_string(length - left) + "M";
+		}
+		default: return to_string(length) + "M";
+		}
+	}
+
+	void format_sequence_and_quality (ostream& out) {
+		static const char bases[] = "ACGT";
+		string seq(options.read_length, 'N'), qual(options.read_length, '!');
+		for (auto i = 0; i < options.read_length; ++i) {
+			auto r = rng();
+			seq[i] = bases[r & 3];
+			// mostly high qualities, with a tail of low ones
+			qual[i] = char(33 + ((r >> 8) % 4 == 0 ? 2 + (r >> 16) % 20 : 25 + (r >> 16) % 17));
+		}
+		out << seq << '\t' << qual;
+	}
+
+	void format_tags (ostream& out) {
+		out << "\tRG:Z:rg1";
+		for (auto t = 0; t < options.nof_tags; ++t) {
+			switch (t) {
+			case 0: out << "\tNM:i:" << uniform(6); break;
+			case 1: out << "\tAS:i:" << (options.read_length - uniform(20)); break;
+			case 2: out << "\tXS:i:" << uniform(options.read_length); break;
+			case 3: out << "\tMD:Z:" << (options.read_length / 2) << 'A' << (options.read_length / 2 - 1); break;
+			default: out << "\tY" << char('A' + (t - 4) % 26) << ":Z:" << hex << rng() << dec; break;
+			}
+		}
+	}
+
+	void format_read (ostream& out, int64_t name, int flag, int32_t contig, int32_t pos, const string& cigar,
+										const string& rnext, int32_t pnext, int32_t tlen) {
+		format_name(out, name);
+		out << '\t' << flag << '\t';
+		if (contig < 0) out << '*'; else out << "chr" << (contig + 1);
+		out << '\t' << pos << '\t' << (contig < 0 ? 0 : 60) << '\t' << cigar << '\t' << rnext << '\t' << pnext << '\t' << tlen << '\t';
+		format_sequence_and_quality(out);
+		format_tags(out);
+		out << '\n';
+	}
+
+	fragment next_fragment () {
+		if (!originals.empty() && chance(options.duplicate_rate)) {
+			return originals[uniform(originals.size())];
+		}
+		fragment f;
+		f.contig = uniform(options.nof_contigs);
+		f.pos = 1 + uniform(options.contig_length - 2 * options.read_length - 500);
+		f.mate_pos = f.pos + 100 + uniform(400);
+		f.reversed = chance(0.5);
+		if (originals.size() < 65536) {
+			originals.push_back(f);
+		} else {
+			originals[uniform(originals.size())] = f;
+		}
+		return f;
+	}
+
+	void generate (ostream& out) {
+		format_header(out);
+		for (int64_t n = 0, name = 0; n < options.nof_reads; ++name) {
+			auto f = next_fragment();
+			auto len = options.read_length;
+			auto unmapped_fragment = chance(options.unmapped_rate);
+			if (chance(options.paired_rate) && (n + 1 < options.nof_reads)) {
+				auto tlen = f.mate_pos + len - f.pos;
+				auto flag1 = 0x1 | 0x2 | 0x40 | (f.reversed ? 0x10 : 0x20);
+				auto flag2 = 0x1 | 0x2 | 0x80 | (f.reversed ? 0x20 : 0x10);
+				if (unmapped_fragment) {
+					flag1 = (flag1 & ~0x2) | 0x8;
+					flag2 = (flag2 & ~0x2) | 0x4;
+					format_read(out, name, flag1, f.contig, f.pos, cigar_for(len), "=", f.pos, 0);
+					format_read(out, name, flag2, f.contig, f.pos, "*", "=", f.pos, 0);
+				} else {
+					format_read(out, name, flag1, f.contig, f.pos, cigar_for(len), "=", f.mate_pos, tlen);
+					format_read(out, name, flag2, f.contig, f.mate_pos, cigar_for(len), "=", f.pos, -tlen);
+				}
+				n += 2;
+			} else {
+				if (unmapped_fragment) {
+					format_read(out, name, 0x4, -1, 0, "*", "*", 0, 0);
+				} else {
+					format_read(out, name, f.reversed ? 0x10 : 0, f.contig, f.pos, cigar_for(len), "*", 0, 0);
+				}
+				n += 1;
+			}
+		}
+	}
+};
+
+void generate_synthetic_sam (ostream& out, const synthetic_sam_options& options) {
+	synthetic_sam_generator(options).generate(out);
+}